@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Apply bulk specs and check the resulting files: users follow their
+# primary group to a new gid, a group can't be removed while it is still
+# some user's primary group, and a user removed and added again in the
+# same spec keeps the memberships given to it.
+
+set -e
+
+: ${UPDATE_PASSWD:=../update-passwd}
+: ${srcdir:=.}
+: ${top_srcdir:=$srcdir/..}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+setup() {
+    cat > "$dir/passwd" <<EOF
+root:x:0:0:root:/root:/bin/sh
+alice:x:1000:1000::/home/alice:/bin/sh
+bob:x:1001:1000::/home/bob:/bin/sh
+carol:x:1002:1002::/home/carol:/bin/sh
+EOF
+    cat > "$dir/group" <<EOF
+root:x:0:
+staff:x:1000:
+carol:x:1002:
+adm:x:4:alice,bob
+EOF
+    cut -d: -f1 "$dir/passwd" | sed 's/$/:*:17000:0:99999:7:::/' > "$dir/shadow"
+}
+
+# Apply the spec on standard input, with the exit status in $status
+apply() {
+    cat > "$dir/spec"
+    status=0
+    "$UPDATE_PASSWD" -L -P "$dir/passwd" -S "$dir/shadow" -G "$dir/group" \
+	--bulk="$dir/spec" > "$dir/out" 2>&1 || status=$?
+}
+
+field() {
+    grep "^$2:" "$dir/$1" | cut -d: -f"$3"
+}
+
+setup
+apply <<EOF
+group-change staff gid 2000
+EOF
+[ $status -eq 0 ] || fail "renumbering a group failed: $(cat "$dir/out")"
+[ "$(field group staff 3)" = 2000 ] || fail "group was not renumbered"
+[ "$(field passwd alice 4)" = 2000 ] || fail "alice kept the old gid $(field passwd alice 4)"
+[ "$(field passwd bob 4)" = 2000 ] || fail "bob kept the old gid $(field passwd bob 4)"
+[ "$(field passwd carol 4)" = 1002 ] || fail "carol was moved to gid $(field passwd carol 4)"
+
+setup
+cp "$dir/group" "$dir/group.before"
+apply <<EOF
+group-remove staff
+EOF
+[ $status -ne 0 ] || fail "removed the primary group of alice and bob"
+cmp -s "$dir/group" "$dir/group.before" || fail "group file changed by a failed spec"
+
+setup
+apply <<EOF
+group-change staff gid 2000
+group-remove staff
+EOF
+[ $status -ne 0 ] || fail "removed a renumbered primary group"
+
+setup
+apply <<EOF
+user-change carol gid staff
+group-remove carol
+EOF
+[ $status -eq 0 ] || fail "could not remove a group no longer in use: $(cat "$dir/out")"
+field group carol 1 | grep -q . && fail "group carol was not removed"
+
+setup
+apply <<EOF
+user-remove alice
+user-add alice 1000 staff
+EOF
+[ $status -eq 0 ] || fail "removing and adding a user failed: $(cat "$dir/out")"
+[ "$(field group adm 4)" = "alice,bob" ] || fail "re-added user lost memberships: $(field group adm 4)"
+
+exit 0
@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# Let several update-passwd runs add users to the same files at the same
+# time.  The lock serializes the writers, and a run that read the files
+# before another one replaced them must give up with exit status 3 rather
+# than overwrite the other's change.  Every writer retries until it gets
+# through, and in the end no added user may be missing.
+#
+# This is done for 1, 2, 4 and so on up to WRITERS writers, and for each
+# the time runs waited for the lock and held it, as reported by --stats,
+# the number of runs that had to be retried and the users added per
+# second are shown, to see how the lock holds up under contention.
+
+set -e
+
+: ${UPDATE_PASSWD:=../update-passwd}
+: ${srcdir:=.}
+: ${top_srcdir:=$srcdir/..}
+
+writers=${WRITERS:-8}
+users=${USERS_PER_WRITER:-5}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+now() {
+    date +%s.%N
+}
+
+# Add the users of one writer one at a time, retrying when another writer
+# got in between.  The lock times of every run, retried or not, go to
+# locks.W.
+writer() {
+    w=$1
+    u=0
+    while [ $u -lt $users ]; do
+	name="w${w}u${u}"
+	echo "user-add $name $((10000+w*100+u)) users - /home/$name /bin/sh" > "$dir/spec.$w"
+	tries=0
+	while :; do
+	    status=0
+	    "$UPDATE_PASSWD" --stats --lock-file="$dir/lock" -P "$dir/passwd" -S "$dir/shadow" \
+		-G "$dir/group" --bulk="$dir/spec.$w" >"$dir/out.$w" 2>>"$dir/errors.$w" || status=$?
+	    sed -n 's/^Lock wait: \([0-9.]*\)s, held: \([0-9.]*\)s$/\1 \2/p' "$dir/out.$w" >> "$dir/locks.$w"
+	    case $status in
+		0) break ;;
+		3) tries=$((tries+1)); echo retry >> "$dir/retries.$w" ;;
+		*) echo "$name: exit status $status" >> "$dir/failed"; return ;;
+	    esac
+	    [ $tries -lt 100 ] || { echo "$name: gave up" >> "$dir/failed"; return; }
+	done
+	# The entry must still be there, no later writer may have lost it
+	grep -q "^$name:" "$dir/passwd" || echo "$name: lost" >> "$dir/failed"
+	u=$((u+1))
+    done
+}
+
+# Run the given number of writers on fresh files and check the outcome
+run() {
+    n=$1
+    rm -f "$dir"/locks.* "$dir"/retries.* "$dir"/out.* "$dir"/errors.* "$dir/failed"
+    cp "$top_srcdir/passwd.master" "$dir/passwd"
+    cp "$top_srcdir/group.master" "$dir/group"
+    cut -d: -f1 "$dir/passwd" | sed 's/$/:*:17000:0:99999:7:::/' > "$dir/shadow"
+
+    start=$(now)
+    w=0
+    while [ $w -lt $n ]; do
+	writer $w &
+	w=$((w+1))
+    done
+    wait
+    end=$(now)
+
+    [ ! -s "$dir/failed" ] || fail "$(cat "$dir/failed")"
+
+    w=0
+    while [ $w -lt $n ]; do
+	u=0
+	while [ $u -lt $users ]; do
+	    grep -q "^w${w}u${u}:" "$dir/passwd" || fail "user w${w}u${u} was lost from passwd"
+	    grep -q "^w${w}u${u}:" "$dir/shadow" || fail "user w${w}u${u} was lost from shadow"
+	    u=$((u+1))
+	done
+	w=$((w+1))
+    done
+
+    awk -F: 'NF!=7 { exit 1 }' "$dir/passwd" || fail "passwd is corrupt"
+    ! ls "$dir"/*.upwd-write >/dev/null 2>&1 || fail "temporary files were left behind"
+
+    retries=$(cat "$dir"/retries.* 2>/dev/null | wc -l)
+    cat "$dir"/locks.* | awk -v n="$n" -v retries="$retries" -v secs="$(echo "$start $end" | awk '{ print $2-$1 }')" '
+	{ runs++; wait+=$1; held+=$2; if ($1>maxwait) maxwait=$1 }
+	END {
+	    printf "%7d %6d %7d %10.3f %10.3f %10.3f %9.1f\n", n, runs-retries, retries,
+		wait/runs, maxwait, held/runs, (runs-retries)/secs
+	}'
+}
+
+printf "%7s %6s %7s %10s %10s %10s %9s\n" writers runs retries "wait:avg" "wait:max" "held:avg" "users/s"
+n=1
+while [ $n -le $writers ]; do
+    run $n
+    n=$((n*2))
+done
+
+exit 0
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Measure the cost of debconf questions: update-passwd is run under the
+# fake frontend with master files that add 1000 to 10000 users, each of
+# which is asked about, once with fresh questions and once with questions
+# seen in an earlier run.  Sizes can be given as arguments; --delay=SECS
+# makes the frontend answer each command that much later.
+
+set -e
+
+: ${UPDATE_PASSWD:=../update-passwd}
+: ${srcdir:=.}
+: ${top_srcdir:=$srcdir/..}
+
+delay=0
+case "$1" in
+    --delay=*) delay=${1#--delay=}; shift ;;
+esac
+[ $# -gt 0 ] || set -- 1000 2000 5000 10000
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+now() {
+    date +%s.%N
+}
+
+# Run once and print the debconf round trips and the seconds taken
+measure() {
+    cp "$top_srcdir/passwd.master" "$dir/passwd"
+    cp "$top_srcdir/group.master" "$dir/group"
+    : > "$dir/shadow"
+    start=$(now)
+    "$srcdir/fake-frontend" --delay="$delay" "$@" -- \
+	"$UPDATE_PASSWD" -L --stats -P "$dir/passwd" -S "$dir/shadow" -G "$dir/group" \
+	-p "$dir/passwd.master" -g "$top_srcdir/group.master" > "$dir/out"
+    end=$(now)
+    trips=$(sed -n 's/^Debconf round trips: \([0-9]*\).*/\1/p' "$dir/out")
+    echo "$trips $start $end" | awk '{ printf " %10d %9.3f", $1, $3-$2 }'
+}
+
+printf "%9s %10s %9s %10s %9s\n" questions commands seconds "seen:cmds" seconds
+for n in "$@"; do
+    awk -v n="$n" 'BEGIN {
+	for (i=0; i<n; i++)
+	    printf "bench%d:*:%d:100:bench:/nonexistent:/usr/sbin/nologin\n", i, 20000+i
+    }' | cat "$top_srcdir/passwd.master" - > "$dir/passwd.master"
+    printf "%9d" "$n"
+    measure --answer=true
+    measure --answer=true --seen
+    printf "\n"
+done
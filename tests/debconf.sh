@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Run update-passwd under the fake debconf frontend and check that the
+# answers given decide what is changed.
+
+set -e
+
+: ${UPDATE_PASSWD:=../update-passwd}
+: ${srcdir:=.}
+: ${top_srcdir:=$srcdir/..}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+setup() {
+    grep -v '^games:' "$top_srcdir/passwd.master" > "$dir/passwd"
+    cp "$top_srcdir/group.master" "$dir/group"
+    cut -d: -f1 "$dir/passwd" | sed 's/$/:*:17000:0:99999:7:::/' > "$dir/shadow"
+}
+
+run() {
+    "$srcdir/fake-frontend" --log="$dir/log" "$@" -- \
+	"$UPDATE_PASSWD" -L -P "$dir/passwd" -S "$dir/shadow" -G "$dir/group" \
+	-p "$top_srcdir/passwd.master" -g "$top_srcdir/group.master" >/dev/null
+}
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# A yes adds the missing user and gives it a shadow entry
+setup
+run --answer=true
+grep -q '^games:' "$dir/passwd" || fail "games was not added"
+grep -q '^games:' "$dir/shadow" || fail "games has no shadow entry"
+grep -q '^INPUT medium base-passwd/[a-z]*/user/games/add$' "$dir/log" ||
+    fail "the question about games was not asked"
+
+# A no leaves the files alone
+setup
+run --answer=false
+! grep -q '^games:' "$dir/passwd" || fail "games was added against the answer"
+
+# Seen questions are answered from the database without asking again
+setup
+run --answer=true --seen
+grep -q '^games:' "$dir/passwd" || fail "the seen answer was not used"
+! grep -q '^INPUT' "$dir/log" || fail "a seen question was asked again"
+
+exit 0
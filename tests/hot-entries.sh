@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Check that --hot-entries moves the master entries to the top of the
+# files, but never across a NIS compat entry: not the plain "+", and not
+# "+name" or "-name" either, as those take part in lookups just as well.
+
+set -e
+
+: ${UPDATE_PASSWD:=../update-passwd}
+: ${srcdir:=.}
+: ${top_srcdir:=$srcdir/..}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+cat > "$dir/passwd.master" <<EOF
+root:*:0:0:root:/root:/bin/sh
+daemon:*:1:1:daemon:/usr/sbin:/usr/sbin/nologin
+bin:*:2:2:bin:/bin:/usr/sbin/nologin
+EOF
+cat > "$dir/group.master" <<EOF
+root:*:0:
+daemon:*:1:
+bin:*:2:
+EOF
+
+cat > "$dir/passwd" <<EOF
+alice:x:1000:1000::/home/alice:/bin/sh
+root:x:0:0:root:/root:/bin/sh
++bob::::::
+daemon:x:1:1:daemon:/usr/sbin:/usr/sbin/nologin
+-carol::::::
+bin:x:2:2:bin:/bin:/usr/sbin/nologin
+EOF
+cat > "$dir/group" <<EOF
+alice:x:1000:
+root:x:0:
+-staff:::
+daemon:x:1:
+bin:x:2:
+EOF
+cut -d: -f1 "$dir/passwd" | sed 's/$/:*:17000:0:99999:7:::/' > "$dir/shadow"
+
+"$UPDATE_PASSWD" -L --hot-entries -P "$dir/passwd" -S "$dir/shadow" -G "$dir/group" \
+    -p "$dir/passwd.master" -g "$dir/group.master" > "$dir/out" 2>&1 ||
+    fail "update-passwd failed: $(cat "$dir/out")"
+
+names() {
+    cut -d: -f1 "$dir/$1" | tr '\n' ' '
+}
+
+[ "$(names passwd)" = "root alice +bob daemon -carol bin " ] ||
+    fail "wrong order of passwd entries: $(names passwd)"
+[ "$(names group)" = "root alice -staff daemon bin " ] ||
+    fail "wrong order of group entries: $(names group)"
+
+exit 0
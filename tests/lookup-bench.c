@@ -0,0 +1,106 @@
+/* lookup-bench -- time user lookups the way nss_files does them
+ *
+ * getpwnam() with the files service reads passwd from the top until it
+ * finds the name, so its cost depends on where the entry is in the file.
+ * This reads a list of names and looks each of them up by scanning the
+ * given file with fgetpwent, several rounds over, and prints the average
+ * time per lookup in microseconds and the average number of entries read.
+ *
+ * Usage: lookup-bench PASSWD NAMES [ROUNDS]
+ */
+
+#include <errno.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Look a name up like nss_files does.  Returns the number of entries read,
+ * or 0 if the name isn't there.
+ */
+unsigned long lookup(FILE* input, const char* name) {
+    struct passwd*	pw;
+    unsigned long	read=0;
+
+    rewind(input);
+    while ((pw=fgetpwent(input))!=NULL) {
+	read++;
+	if (strcmp(pw->pw_name, name)==0)
+	    return read;
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char** argv) {
+    FILE*		input;
+    FILE*		list;
+    char**		names=NULL;
+    size_t		count=0;
+    char*		line=NULL;
+    size_t		size=0;
+    ssize_t		len;
+    unsigned long	rounds=100;
+    unsigned long	entries=0;
+    unsigned long	found;
+    unsigned long	r;
+    struct timespec	start;
+    struct timespec	end;
+    double		seconds;
+    size_t		i;
+
+    if (argc<3 || argc>4) {
+	fprintf(stderr, "Usage: %s PASSWD NAMES [ROUNDS]\n", argv[0]);
+	return 1;
+    }
+    if (argc==4 && (rounds=strtoul(argv[3], NULL, 10))==0) {
+	fprintf(stderr, "Invalid number of rounds \"%s\"\n", argv[3]);
+	return 1;
+    }
+
+    if ((list=fopen(argv[2], "r"))==NULL) {
+	fprintf(stderr, "Failed to open %s: %s\n", argv[2], strerror(errno));
+	return 1;
+    }
+    while ((len=getline(&line, &size, list))!=-1) {
+	if (len>0 && line[len-1]=='\n')
+	    line[--len]='\0';
+	if (len==0)
+	    continue;
+	if ((names=realloc(names, (count+1)*sizeof(char*)))==NULL ||
+		(names[count]=strdup(line))==NULL) {
+	    fprintf(stderr, "Out of memory!\n");
+	    return 1;
+	}
+	count++;
+    }
+    free(line);
+    fclose(list);
+
+    if ((input=fopen(argv[1], "r"))==NULL) {
+	fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+	return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (r=0; r<rounds; r++)
+	for (i=0; i<count; i++) {
+	    if ((found=lookup(input, names[i]))==0) {
+		fprintf(stderr, "User \"%s\" not found in %s\n", names[i], argv[1]);
+		return 1;
+	    }
+	    entries+=found;
+	}
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(input);
+
+    seconds=(end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+    if (count==0)
+	count=1;
+    printf("%.2f %.1f\n", seconds*1e6/(rounds*count), (double)entries/(rounds*count));
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Measure what --hot-entries does for getpwnam: a passwd file with 1000 to
+# 50000 local users in front of the system accounts from passwd.master is
+# updated with --hot-entries, and lookup-bench times lookups of the system
+# accounts in the file before and after.  Sizes can be given as arguments.
+
+set -e
+
+: ${UPDATE_PASSWD:=../update-passwd}
+: ${LOOKUP_BENCH:=./lookup-bench}
+: ${srcdir:=.}
+: ${top_srcdir:=$srcdir/..}
+
+[ $# -gt 0 ] || set -- 1000 5000 20000 50000
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+grep -v '^[+-]' "$top_srcdir/passwd.master" | cut -d: -f1 > "$dir/names"
+
+printf "%8s %10s %8s %10s %8s\n" users "before:us" entries "after:us" entries
+for n in "$@"; do
+    awk -v n="$n" 'BEGIN {
+	for (i=0; i<n; i++)
+	    printf "local%d:x:%d:100:local:/home/local%d:/bin/sh\n", i, 20000+i, i
+    }' | cat - "$top_srcdir/passwd.master" > "$dir/passwd"
+    cp "$dir/passwd" "$dir/passwd.before"
+    cp "$top_srcdir/group.master" "$dir/group"
+    : > "$dir/shadow"
+    "$UPDATE_PASSWD" -L --hot-entries -P "$dir/passwd" -S "$dir/shadow" -G "$dir/group" \
+	-p "$top_srcdir/passwd.master" -g "$top_srcdir/group.master" > /dev/null
+
+    # Fewer rounds for bigger files, so every size takes about as long
+    rounds=$((2000000/n/$(wc -l < "$dir/names")+1))
+    printf "%8d" "$n"
+    "$LOOKUP_BENCH" "$dir/passwd.before" "$dir/names" "$rounds" | awk '{ printf " %10.2f %8.1f", $1, $2 }'
+    "$LOOKUP_BENCH" "$dir/passwd" "$dir/names" "$rounds" | awk '{ printf " %10.2f %8.1f", $1, $2 }'
+    printf "\n"
+done
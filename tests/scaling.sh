@@ -0,0 +1,172 @@
+#!/bin/sh
+#
+# Check that the work done grows linearly with the size of the files.
+# Fixtures of 1000 to 64000 entries are run through update-passwd with
+# --stats, and the counts it reports are fitted against the size on a
+# log-log scale.  The slope is 1 for linear work and 2 for quadratic work;
+# a pass that walks a list for every entry shows up as a slope well above
+# 1 long before it is slow enough to notice.  Parsing, and the index
+# probes and list steps of every pass over the master entries, are fitted
+# on their own, so that one pass going quadratic can't hide behind the
+# others.
+#
+# There are two kinds of fixtures.  In the "spread" ones each size has N
+# master users and groups with ids from 100000 up, half of which are
+# missing from the system files, an eighth of which come after the NIS
+# compat entry, and N local users and groups in front of them.  Only ids
+# 0-99 and 65534 are ours to remove or change, so the "range" fixtures
+# give all N master entries such ids, shared by many names: a quarter are
+# missing, a quarter have a different uid or gid, a quarter have other
+# fields or members changed, and N/4 system entries in the range aren't
+# in the master files at all.
+
+set -e
+
+: ${UPDATE_PASSWD:=../update-passwd}
+: ${srcdir:=.}
+: ${top_srcdir:=$srcdir/..}
+
+sizes=${SIZES:-1000 4000 16000 64000}
+engines=${ENGINES:-indexed parallel}
+
+# Highest slopes let through; a little above 1 for hash table growth and
+# the noise of the small sizes
+max_parse=1.1
+max_work=1.2
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+make_spread_fixture() {
+    awk -v n="$1" -v dir="$2" 'BEGIN {
+	passwd=dir "/passwd"; group=dir "/group"
+	for (i=0; i<n; i++) {
+	    printf "m%d:x:%d:%d:master:/nonexistent:/usr/sbin/nologin\n", i, 100000+i, 100000+i > (dir "/passwd.master")
+	    printf "m%d:x:%d:m%d,l%d\n", i, 100000+i, i, i > (dir "/group.master")
+	}
+	for (i=0; i<n; i++) {
+	    printf "l%d:x:%d:100:local:/home/l%d:/bin/sh\n", i, 200000+i, i > passwd
+	    printf "l%d:x:%d:\n", i, 200000+i > group
+	}
+	for (i=0; i<n; i+=2)
+	    if (i%16!=0) {
+		printf "m%d:x:%d:%d:master:/nonexistent:/usr/sbin/nologin\n", i, 100000+i, 100000+i > passwd
+		printf "m%d:x:%d:m%d\n", i, 100000+i, i > group
+	    }
+	print "+" > passwd
+	print "+" > group
+	for (i=0; i<n; i+=16) {
+	    printf "m%d:x:%d:%d:master:/nonexistent:/usr/sbin/nologin\n", i, 100000+i, 100000+i > passwd
+	    printf "m%d:x:%d:m%d\n", i, 100000+i, i > group
+	}
+    }'
+    : > "$2/shadow"
+}
+
+make_range_fixture() {
+    awk -v n="$1" -v dir="$2" '
+	function id(i) { return i%10==9 ? 65534 : i%100 }
+	BEGIN {
+	passwd=dir "/passwd"; group=dir "/group"
+	for (i=0; i<n; i++) {
+	    printf "s%d:x:%d:%d:master:/nonexistent:/usr/sbin/nologin\n", i, id(i), id(i) > (dir "/passwd.master")
+	    printf "s%d:x:%d:s%d\n", i, id(i), i > (dir "/group.master")
+	}
+	for (i=0; i<n; i++) {
+	    if (i%4==0)
+		continue
+	    if (i%4==2) {
+		printf "s%d:x:%d:%d:master:/nonexistent:/usr/sbin/nologin\n", i, id(i+1), id(i+1) > passwd
+		printf "s%d:x:%d:s%d\n", i, id(i+1), i > group
+	    } else if (i%4==3) {
+		printf "s%d:x:%d:%d:changed:/home/s%d:/bin/sh\n", i, id(i), id(i), i > passwd
+		printf "s%d:x:%d:s%d,l%d\n", i, id(i), i+1, i > group
+	    } else {
+		printf "s%d:x:%d:%d:master:/nonexistent:/usr/sbin/nologin\n", i, id(i), id(i) > passwd
+		printf "s%d:x:%d:s%d\n", i, id(i), i > group
+	    }
+	}
+	for (i=0; i<n; i+=4) {
+	    printf "o%d:x:%d:%d:old:/nonexistent:/usr/sbin/nologin\n", i, id(i), id(i) > passwd
+	    printf "o%d:x:%d:\n", i, id(i) > group
+	}
+	for (i=0; i<n; i++) {
+	    printf "l%d:x:%d:100:local:/home/l%d:/bin/sh\n", i, 200000+i, i > passwd
+	    printf "l%d:x:%d:\n", i, 200000+i > group
+	}
+    }'
+    : > "$2/shadow"
+}
+
+for kind in spread range; do
+    for n in $sizes; do
+	mkdir -p "$dir/$kind/$n"
+	make_${kind}_fixture "$n" "$dir/$kind/$n"
+    done
+done
+
+for kind in spread range; do
+    for engine in $engines; do
+	for n in $sizes; do
+	    f="$dir/$kind/$n"
+	    # A dry run exits with the number of changes it would make
+	    "$UPDATE_PASSWD" -n --stats --engine="$engine" --member-policy=add \
+		--log-format=jsonl --log-fd=3 \
+		-P "$f/passwd" -S "$f/shadow" -G "$f/group" \
+		-p "$f/passwd.master" -g "$f/group.master" > "$f/out" 3> "$f/log" || :
+	    sed -n -e "s/^Operations: \([0-9]*\) entries parsed.*/$n \1 parsed/p" \
+		-e "s/^Operations for \(.*\): \([0-9]*\) index probes, \([0-9]*\) list steps$/$n \2 probes in \1\n$n \3 steps in \1/p" \
+		"$f/out"
+	done > "$dir/ops.$kind.$engine"
+	[ $(grep -c parsed "$dir/ops.$kind.$engine") -eq $(echo $sizes | wc -w) ] ||
+	    fail "no operation counts from the $engine engine"
+	grep -q "probes in changed users" "$dir/ops.$kind.$engine" ||
+	    fail "no operation counts per pass from the $engine engine"
+
+	# Least squares fit of log(count) against log(size), for every
+	# counter on its own.  One is added to the counts so that a pass
+	# with nothing to do at some size doesn't take the log of zero.
+	awk -v label="$kind fixtures, $engine engine" -v max_parse="$max_parse" -v max_work="$max_work" '
+	    function slope(c,    i, mx, my, sxy, sxx) {
+		mx=my=sxy=sxx=0
+		for (i=1; i<=n[c]; i++) { mx+=log(size[c, i]); my+=log(v[c, i]+1) }
+		mx/=n[c]; my/=n[c]
+		for (i=1; i<=n[c]; i++) {
+		    sxy+=(log(size[c, i])-mx)*(log(v[c, i]+1)-my)
+		    sxx+=(log(size[c, i])-mx)^2
+		}
+		return sxy/sxx
+	    }
+	    {
+		c=$0; sub(/^[0-9]+ [0-9]+ /, "", c)
+		if (!(c in n))
+		    order[++counters]=c
+		n[c]++; size[c, n[c]]=$1; v[c, n[c]]=$2
+	    }
+	    END {
+		printf "%s:\n", label
+		for (i=1; i<=counters; i++) {
+		    c=order[i]
+		    s=slope(c)
+		    max=(c=="parsed" ? max_parse : max_work)
+		    printf "    %-28s slope %6.3f%s\n", c, s, (s>max ? "  too steep" : "")
+		    if (s>max)
+			bad++
+		}
+		exit bad>0
+	    }' "$dir/ops.$kind.$engine" ||
+	    fail "work grows faster than linearly with the $engine engine on the $kind fixtures"
+    done
+done
+
+# The range fixtures must keep the passes that only look at ids 0-99 and
+# 65534 busy, or their slopes above say nothing
+log="$dir/range/$(echo $sizes | awk '{ print $NF }')/log"
+for record in user-remove group-remove user-change-uid group-change-gid user-change-gid user-add group-add; do
+    grep -q "\"$record\"" "$log" || fail "the range fixtures make no $record decisions"
+done
@@ -38,6 +38,12 @@
 #include <grp.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
 
 #include <cdebconf/debconfclient.h>
 
@@ -46,9 +52,41 @@
 #define DEFAULT_PASSWD_SYSTEM	"/etc/passwd"
 #define DEFAULT_SHADOW_SYSTEM	_PATH_SHADOW
 #define DEFAULT_GROUP_SYSTEM	"/etc/group"
+#define DEFAULT_SUBUID_SYSTEM	"/etc/subuid"
+#define DEFAULT_SUBGID_SYSTEM	"/etc/subgid"
 
 #define DEFAULT_DEBCONF_DOMAIN	"system"
 
+/* The dynamic system id range and default shell used for sysusers.d
+ * entries, as in systemd-sysusers.
+ */
+#define SYSUSERS_ID_MIN		100
+#define SYSUSERS_ID_MAX		999
+#define SYSUSERS_SHELL		"/usr/sbin/nologin"
+
+#define CGROUP_ROOT		"/sys/fs/cgroup"
+#define PROC_SELF_CGROUP	"/proc/self/cgroup"
+#define CGROUP_CPU_MAX		"cpu.max"
+#define CGROUP_MEMORY_MAX	"memory.max"
+
+/* Inputs below this many bytes, a few hundred entries, are matched by
+ * walking the lists; building indexes costs more than it saves.  Inputs
+ * of at least PARALLEL_MIN bytes are worth spreading over threads, if
+ * there is memory for about PARALLEL_FOOTPRINT times their size.
+ */
+#define SIMPLE_MAX		(16*1024)
+#define PARALLEL_MIN		(4*1024*1024)
+#define PARALLEL_FOOTPRINT	8
+
+#define NONEXISTENT_HOME	"/nonexistent"
+
+/* Threads for work that mostly waits for the disk or the network */
+#define IO_THREADS		32
+#define CHECK_PATHS_BATCH	16
+#define CHOWN_STACK_SIZE	256
+
+#define LOG_BUFFER_SIZE		(1024*1024)
+
 #define	WRITE_EXTENSION		".upwd-write"
 #define	BACKUP_EXTENSION	".org"
 
@@ -61,6 +99,52 @@
 #define FL_NOAUTOREMOVE	0x0010
 #define FL_NOAUTOADD	0x0020
 
+/* Values for long options that have no short equivalent */
+enum {
+    OPT_PIPELINE=256,
+    OPT_BACKGROUND,
+    OPT_STATS,
+    OPT_DIFF,
+    OPT_JSON,
+    OPT_JOBS,
+    OPT_EXTRA_SET,
+    OPT_SYSUSERS,
+    OPT_POPULATE,
+    OPT_STATE_DIR,
+    OPT_FULL_CHECK,
+    OPT_ANONYMIZE,
+    OPT_LOCK_FILE,
+    OPT_LOG_FORMAT,
+    OPT_LOG_FD,
+    OPT_BULK,
+    OPT_CHECK_PATHS,
+    OPT_CHOWN_TREE,
+    OPT_ENGINE,
+    OPT_MEMBER_POLICY,
+    OPT_HOT_ENTRIES,
+    OPT_SUBIDS,
+    OPT_SUBID_USERS
+};
+
+/* How entries are matched against the master files, see choose_engine */
+enum {
+    ENGINE_AUTO,
+    ENGINE_SIMPLE,
+    ENGINE_INDEXED,
+    ENGINE_PARALLEL
+};
+
+const char* engine_names[] = { "auto", "simple", "indexed", "parallel", NULL };
+
+/* Value of --jobs and --pipeline until choose_engine has settled them */
+#define SETTING_AUTO		(-1)
+
+/* ioprio_set(2) has no glibc wrapper or header */
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+
 /* This structure is actually used for both users and groups
  * we probably should split that someday.
  */
@@ -101,18 +185,11 @@ const struct _info specialgroups[] = {
     { 0, 0}
 };
 
+/* The list header shared by all entries.  Each database has its own record
+ * type that starts with this header, followed only by the fields of that
+ * database, so a node never carries space for the other kinds of entry.
+ */
 struct _node {
-    union {
-	struct passwd	pw;
-	struct spwd	sp;
-	struct group	gr;
-    } d;
-    enum {
-	t_passwd,
-	t_shadow,
-	t_group,
-	t_error
-    } t;
     const char*		name;
     uid_t		id;
     struct _node*	next;
@@ -120,6 +197,37 @@ struct _node {
     struct _node*	last;
 };
 
+struct _pwnode {
+    struct _node	n;
+    struct passwd	pw;
+};
+
+struct _spnode {
+    struct _node	n;
+    struct spwd		sp;
+};
+
+struct _grnode {
+    struct _node	n;
+    struct group	gr;
+};
+
+/* Access the entry of a record from its list header */
+#define PW(node)	(&((struct _pwnode*)(node))->pw)
+#define SP(node)	(&((struct _spnode*)(node))->sp)
+#define GR(node)	(&((struct _grnode*)(node))->gr)
+
+/* A range of subordinate ids from the subuid or subgid file.  The list
+ * header carries the name of the user owning it.
+ */
+struct _subnode {
+    struct _node	n;
+    unsigned long	start;
+    unsigned long	count;
+};
+
+#define SUB(node)	((struct _subnode*)(node))
+
 const char*	master_passwd	= DEFAULT_PASSWD_MASTER;
 const char*	master_group	= DEFAULT_GROUP_MASTER;
 const char*	sys_passwd	= DEFAULT_PASSWD_SYSTEM;
@@ -132,36 +240,205 @@ struct _node*	system_accounts	= NULL;
 struct _node*	system_shadow	= NULL;
 struct _node*	system_groups	= NULL;
 
+/* Additional passwd and group files, such as those of libnss-extrausers,
+ * that are checked against the master files along with the system ones.
+ */
+#define MAX_EXTRA_SETS	16
+
+struct _fileset {
+    const char*		passwd;
+    const char*		group;
+    struct _node*	accounts;
+    struct _node*	groups;
+    int			dirty;
+};
+
+struct _fileset	extra_sets[MAX_EXTRA_SETS];
+int		extra_count	= 0;
+
+/* The subordinate id files kept in line with the accounts by --subids */
+struct _subids {
+    const char*		file;
+    const char*		descr;
+    struct _node*	ranges;
+    int			dirty;
+};
+
+struct _subids	subids[2] = {
+    { DEFAULT_SUBUID_SYSTEM, "subuid", NULL, 0 },
+    { DEFAULT_SUBGID_SYSTEM, "subgid", NULL, 0 },
+};
+
+/* Trees whose files follow renumbered users and groups */
+#define MAX_CHOWN_TREES	16
+
+const char*	chown_trees[MAX_CHOWN_TREES];
+int		chown_count	= 0;
+
+/* A growable array of list entries */
+struct _nodelist {
+    struct _node**	nodes;
+    size_t		count;
+    size_t		size;
+};
+
+/* Accounts added to or removed from the system passwd file.  The shadow
+ * file is only read and updated if there are any.
+ */
+struct _nodelist	accounts_added;
+struct _nodelist	accounts_removed;
+
 int		opt_dryrun	= 0;
 int		opt_verbose	= 0;
 int		opt_nolock	= 0;
 int		opt_sanity	= 0;
+int		opt_pipeline	= SETTING_AUTO;
+int		opt_background	= 0;
+int		opt_stats	= 0;
+int		opt_json	= 0;
+long		opt_jobs	= SETTING_AUTO;
+int		opt_engine	= ENGINE_AUTO;
+int		opt_sysusers	= 0;
+int		opt_populate	= 0;
+int		opt_fullcheck	= 0;
+int		opt_jsonlog	= 0;
+int		opt_checkpaths	= 0;
+int		opt_hot		= 0;
+int		opt_subids	= 0;
+const char*	opt_state_dir	= NULL;
+const char*	opt_anonymize	= NULL;
+const char*	opt_diff	= NULL;
+const char*	opt_lockfile	= NULL;
+const char*	opt_bulk	= NULL;
+int		opt_logfd	= STDOUT_FILENO;
 
 int		flag_dirty	= 0;
 int		flag_debconf	= 0;
+int		flag_background	= 0;
+int		flag_shadow	= 0;
+
+/* The decision log for --log-format=jsonl, NULL if not logging */
+FILE*		log_stream	= NULL;
 
 const char*	user_domain	= DEFAULT_DEBCONF_DOMAIN;
 const char*	group_domain	= DEFAULT_DEBCONF_DOMAIN;
 
 struct debconfclient*	debconf	= NULL;
 
+/* Counters reported by --stats */
+struct _stats {
+    struct timespec	start;
+    struct timespec	debconf_start;
+    unsigned long	debconf_commands;
+    double		debconf_seconds;
+    unsigned long	debconf_reused;
+    unsigned long	hot_entries;
+    unsigned long	hot_moved;
+    unsigned long	hot_depth_before;
+    unsigned long	hot_depth_after;
+    struct timespec	lock_taken;
+    double		lock_wait;
+    double		lock_held;
+    unsigned long	path_references;
+    unsigned long	paths_checked;
+    double		path_seconds;
+    unsigned long	chown_scanned;
+    unsigned long	chown_changed;
+    double		chown_seconds;
+} stats;
+
+/* Operations counted for --stats.  They grow with the work done rather
+ * than with the time it took, so runs on inputs of different sizes show
+ * how each part scales on any machine, however busy.  Every thread counts
+ * into its own copy; threads that read or match entries hand theirs back
+ * when they are joined.
+ */
+struct _ops {
+    unsigned long	parsed;		/* entries read from the files */
+    unsigned long	probes;		/* index slots looked at */
+    unsigned long	steps;		/* list entries walked through */
+};
+
+__thread struct _ops	ops;
+
+/* Add the operations counted by another thread to ours.
+ */
+void merge_ops(const struct _ops* other) {
+    ops.parsed+=other->parsed;
+    ops.probes+=other->probes;
+    ops.steps+=other->steps;
+}
+
+/* The operations of each pass over the master entries, so that --stats
+ * shows which of them grows faster than the others.  end_phase() charges
+ * a pass with everything counted since the previous one ended, or since
+ * start_phases().
+ */
+#define MAX_PHASES	16
+
+struct _phase {
+    const char*		name;
+    struct _ops		ops;
+};
+
+struct _phase	phases[MAX_PHASES];
+unsigned	phase_count;
+struct _ops	phase_mark;
+
+void start_phases() {
+    phase_mark=ops;
+}
+
+void end_phase(const char* name) {
+    if (phase_count<MAX_PHASES) {
+	phases[phase_count].name=name;
+	phases[phase_count].ops.parsed=ops.parsed-phase_mark.parsed;
+	phases[phase_count].ops.probes=ops.probes-phase_mark.probes;
+	phases[phase_count].ops.steps=ops.steps-phase_mark.steps;
+	phase_count++;
+    }
+    phase_mark=ops;
+}
+
+/* Return the number of seconds elapsed since a point in time.
+ */
+double elapsed_since(const struct timespec* since) {
+    struct timespec	now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec-since->tv_sec)+(now.tv_nsec-since->tv_nsec)/1e9;
+}
+
+/* Account for one debconf round trip that started at
+ * stats.debconf_start, passing its result through.
+ */
+int debconf_done(int ret) {
+    stats.debconf_commands++;
+    stats.debconf_seconds+=elapsed_since(&stats.debconf_start);
+    return ret;
+}
+
+/* Evaluate a debconf command, timing the round trip for --stats. */
+#define DEBCONF_TIMED(cmd) \
+    (clock_gettime(CLOCK_MONOTONIC, &stats.debconf_start), debconf_done(cmd))
+
 /* Abort the program if talking to debconf fails.  Use ret exactly once. */
 #define DEBCONF_CHECK(ret)					\
     do {							\
-	if ((ret)!=0) {						\
+	if (DEBCONF_TIMED(ret)!=0) {				\
 	    fprintf(stderr, "Debconf interaction failed\n");	\
 	    exit(1);						\
 	}							\
     } while (0)
 
-/* Wrapper macros around the debconfclient interface that check the return
- * status and use the global debconf client.  The mechanics of asking the
- * question and retrieving the answer are handled by the ask_debconf
- * function below. */
+/* Wrapper macros around the debconfclient interface that use the global
+ * debconf client.  The question is only registered and filled in once
+ * ask_debconf below knows that it has to be shown, so these merely record
+ * the template and substitutions. */
 #define DEBCONF_REGISTER(template, question) \
-    DEBCONF_CHECK(debconf_register(debconf, (template), (question)))
+    prepare_debconf((template))
 #define DEBCONF_SUBST(question, var, value) \
-    DEBCONF_CHECK(debconf_subst(debconf, (question), (var), (value)))
+    prepare_debconf_subst((var), (value))
 
 
 /* malloc() with out-of-memory checking.
@@ -178,6 +455,16 @@ void* xmalloc(size_t n) {
     return p;
 }
 
+/* realloc() with out-of-memory checking.
+ */
+void* xrealloc(void* p, size_t n) {
+    if ((p=realloc(p, n ? n : 1))==NULL) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    return p;
+}
+
 /* Copy a string with out-of-memory checking.
  */
 char* xstrdup(const char *string) {
@@ -204,87 +491,140 @@ char* xasprintf(const char* fmt, ...) {
     return result;
 }
 
-/* Create an empty list-entry
- */
-struct _node* create_node() {
-    struct _node*	newnode;
-
-    newnode=(struct _node*)xmalloc(sizeof(struct _node));
-    newnode->name=0;
-    newnode->id=0;
-    newnode->next=NULL;
-    newnode->prev=NULL;
-    newnode->last=NULL;
-    newnode->t=t_error;
-
-    return newnode;
-}
-
-
-void copy_passwd(struct _node* newnode, const struct passwd* pw) {
-    newnode->d.pw=*pw;
-    newnode->d.pw.pw_name=xstrdup(pw->pw_name);
-    newnode->d.pw.pw_passwd=xstrdup(pw->pw_passwd);
-    newnode->d.pw.pw_gecos=xstrdup(pw->pw_gecos);
-    newnode->d.pw.pw_dir=xstrdup(pw->pw_dir);
-    newnode->d.pw.pw_shell=xstrdup(pw->pw_shell);
+void copy_passwd(struct passwd* newpw, const struct passwd* pw) {
+    *newpw=*pw;
+    newpw->pw_name=xstrdup(pw->pw_name);
+    newpw->pw_passwd=xstrdup(pw->pw_passwd);
+    newpw->pw_gecos=xstrdup(pw->pw_gecos);
+    newpw->pw_dir=xstrdup(pw->pw_dir);
+    newpw->pw_shell=xstrdup(pw->pw_shell);
 }
 
 
-void copy_shadow(struct _node* newnode, const struct spwd* sp) {
-    newnode->d.sp=*sp;
-    newnode->d.sp.sp_namp=xstrdup(sp->sp_namp);
-    newnode->d.sp.sp_pwdp=xstrdup(sp->sp_pwdp);
+void copy_spwd(struct spwd* newsp, const struct spwd* sp) {
+    *newsp=*sp;
+    newsp->sp_namp=xstrdup(sp->sp_namp);
+    newsp->sp_pwdp=xstrdup(sp->sp_pwdp);
 }
 
 
-void copy_group(struct _node* newnode, const struct group* gr) {
+void copy_group(struct group* newgr, const struct group* gr) {
     int		memcount, mem;
 
-    newnode->d.gr=*gr;
-    newnode->d.gr.gr_name=xstrdup(gr->gr_name);
-    newnode->d.gr.gr_passwd=xstrdup(gr->gr_passwd);
+    *newgr=*gr;
+    newgr->gr_name=xstrdup(gr->gr_name);
+    newgr->gr_passwd=xstrdup(gr->gr_passwd);
 
     for (memcount=0; gr->gr_mem[memcount]; ++memcount)
 	;
-    newnode->d.gr.gr_mem=xmalloc((memcount+1) * sizeof(char*));
+    newgr->gr_mem=xmalloc((memcount+1) * sizeof(char*));
     for (mem=0; mem<memcount; ++mem)
-	newnode->d.gr.gr_mem[mem]=xstrdup(gr->gr_mem[mem]);
-    newnode->d.gr.gr_mem[memcount]=NULL;
+	newgr->gr_mem[mem]=xstrdup(gr->gr_mem[mem]);
+    newgr->gr_mem[memcount]=NULL;
 }
 
-/* Make a copy of a list-entry
+
+void insert_node(struct _node** head, struct _node* node, struct _node* before);
+void remove_node(struct _node** head, struct _node* node);
+struct _node* find_by_name(struct _node* head, const char* name);
+void nodelist_append(struct _nodelist* list, struct _node* node);
+void choose_new_entries(const struct _info* lst, struct _node* list, struct _node* master, const char* descr, struct _nodelist* chosen);
+void choose_old_entries(const struct _info* lst, struct _node* list, struct _node* master, const char* descr, struct _nodelist* chosen);
+
+/* Generate the functions to create a list-entry of a given record type
+ * from a database entry, and to make a copy of such a list-entry.  The
+ * name of the new entry points into its own copy of the data.
+ *
+ * Also generate the passes that add master entries to a list of that type
+ * and remove entries from it.  Each only gets lists of its own type, so
+ * the entries it copies are known to be records of that type.  The
+ * entries added or removed are appended to ADDED or REMOVED unless they
+ * are NULL.
  */
-struct _node* copy_node(const struct _node* node) {
-    struct _node*	newnode;
+#define DEFINE_NODE_TYPE(type, record, field, namefield)		\
+struct _node* new_##type##_node(const struct type* entry) {		\
+    struct record*	newnode;					\
+									\
+    newnode=(struct record*)xmalloc(sizeof(struct record));		\
+    copy_##type(&newnode->field, entry);				\
+    newnode->n.name=newnode->field.namefield;				\
+    newnode->n.id=0;							\
+    newnode->n.next=NULL;						\
+    newnode->n.prev=NULL;						\
+    newnode->n.last=NULL;						\
+									\
+    return &newnode->n;							\
+}									\
+									\
+struct _node* copy_##type##_node(const struct record* node) {		\
+    struct _node*	newnode;					\
+									\
+    newnode=new_##type##_node(&node->field);				\
+    newnode->id=node->n.id;						\
+									\
+    return newnode;							\
+}									\
+									\
+void process_new_##type(const struct _info* lst, struct _node** list, struct _node* master, const char* descr, struct _nodelist* added) { \
+    struct _nodelist	chosen={ NULL, 0, 0 };				\
+    struct _node*	plus=find_by_name(*list, "+");			\
+    struct _node*	newnode;					\
+    size_t		i;						\
+									\
+    choose_new_entries(lst, *list, master, descr, &chosen);		\
+    for (i=0; i<chosen.count; i++) {					\
+	newnode=copy_##type##_node((const struct record*)chosen.nodes[i]); \
+	insert_node(list, newnode, plus);				\
+	if (added)							\
+	    nodelist_append(added, newnode);				\
+    }									\
+    free(chosen.nodes);							\
+}									\
+									\
+void process_old_##type(const struct _info* lst, struct _node** list, struct _node* master, const char* descr, struct _nodelist* removed) { \
+    struct _nodelist	chosen={ NULL, 0, 0 };				\
+    size_t		i;						\
+									\
+    choose_old_entries(lst, *list, master, descr, &chosen);		\
+    for (i=0; i<chosen.count; i++) {					\
+	remove_node(list, chosen.nodes[i]);				\
+	if (removed)							\
+	    nodelist_append(removed, chosen.nodes[i]);			\
+    }									\
+    free(chosen.nodes);							\
+}
 
-    newnode=create_node();
-    newnode->id=node->id;
-    newnode->name=node->name;
-    newnode->t=node->t;
+DEFINE_NODE_TYPE(passwd, _pwnode, pw, pw_name)
+DEFINE_NODE_TYPE(spwd, _spnode, sp, sp_namp)
+DEFINE_NODE_TYPE(group, _grnode, gr, gr_name)
 
-    switch (newnode->t) {
-	case t_passwd:
-	    copy_passwd(newnode, &node->d.pw);
-	    break;
-	case t_shadow:
-	    copy_shadow(newnode, &node->d.sp);
-	    break;
-	case t_group:
-	    copy_group(newnode, &node->d.gr);
-	    break;
-	default:
-	    fprintf(stderr, "Internal error: unexpected entrytype %d\n", newnode->t);
-	    exit(1);
-    }
 
-    return newnode;
+/* Small helper functions to safely print strings that might be NULL.
+ */
+const char* safestr(const char* str) {
+    if (str==NULL)
+	return "";
+    else
+	return str;
+}
+
+
+/* Append an entry to an array of entries.  The array doubles in size
+ * when it is full, so that appending stays cheap for large batches.
+ */
+void nodelist_append(struct _nodelist* list, struct _node* node) {
+    if (list->count==list->size) {
+	list->size=list->size ? 2*list->size : 16;
+	list->nodes=xrealloc(list->nodes, list->size*sizeof(struct _node*));
+    }
+    list->nodes[list->count++]=node;
 }
 
 
-/* Add a new item to a list
+/* Insert an item into a list before another item, or at the end of the
+ * list if that is NULL.
  */
-void add_node(struct _node** head, struct _node* node, int new_entry) {
+void insert_node(struct _node** head, struct _node* node, struct _node* before) {
     node->prev=NULL;
     node->next=NULL;
 
@@ -294,36 +634,42 @@ void add_node(struct _node** head, struct _node* node, int new_entry) {
 	return;
     }
 
+    if (before) {
+	node->prev=before->prev;
+	node->next=before;
+	if (before->prev)
+	    before->prev->next=node;
+	before->prev=node;
+	if (before==*head) {
+	    node->last=(*head)->last;
+	    *head=node;
+	}
+	return;
+    }
+
+    (*head)->last->next=node;
+    node->prev=(*head)->last;
+    (*head)->last=node;
+}
+
+
+/* Add a new item to a list
+ */
+void add_node(struct _node** head, struct _node* node, int new_entry) {
+    struct _node*	walk=NULL;
+
     if (new_entry) {
 	/* Make sure NIS compat entries stay at the end when adding new
 	 * entries.
 	 */
-	struct _node*	walk;
 	for (walk=*head; walk; walk=walk->next) {
+	    ops.steps++;
 	    if (strcmp(walk->name, "+")==0)
 		break;
 	}
-	/* Was there a "+" entry at all?
-	 */
-	if (walk) {
-	    node->prev=walk->prev;
-	    node->next=walk;
-	    if (walk->prev)
-		walk->prev->next=node;
-	    walk->prev=node;
-	    if (walk==*head) {
-		node->last=(*head)->last;
-		*head=node;
-	    }
-	    return;
-	}
-	/* Otherwise fall through and add as normal.
-	 */
     }
 
-    (*head)->last->next=node;
-    node->prev=(*head)->last;
-    (*head)->last=node;
+    insert_node(head, node, walk);
 }
 
 
@@ -354,6 +700,7 @@ void remove_node(struct _node** head, struct _node* node) {
  */
 struct _node* find_by_name(struct _node* head, const char* name) {
     while (head) {
+	ops.steps++;
 	if (strcmp(name, head->name)==0)
 	    return head;
 	head=head->next;
@@ -368,6 +715,7 @@ struct _node* find_by_name(struct _node* head, const char* name) {
  */
 struct _node* find_by_named_entry(struct _node* head, const struct _node* entry) {
     while (head) {
+	ops.steps++;
 	if (strcmp(entry->name, head->name)==0)
 	    return head;
 	head=head->next;
@@ -382,6 +730,7 @@ struct _node* find_by_named_entry(struct _node* head, const struct _node* entry)
  */
 struct _node* find_by_id(struct _node* head, uid_t id) {
     while (head) {
+	ops.steps++;
 	if (id==head->id)
 	    return head;
 	head=head->next;
@@ -391,6 +740,381 @@ struct _node* find_by_id(struct _node* head, uid_t id) {
 }
 
 
+/* A hash index over the names in a list, for lookups that don't have to
+ * walk the whole list.  When a name occurs more than once the first entry
+ * wins, just like with find_by_name.
+ */
+struct _index {
+    struct _node**	slots;
+    size_t		size;
+    size_t		count;
+};
+
+
+/* FNV-1a hash of a name
+ */
+unsigned long hash_name(const char* name) {
+    unsigned long	hash=2166136261UL;
+
+    for (; *name; name++) {
+	hash^=(unsigned char)*name;
+	hash*=16777619UL;
+    }
+
+    return hash;
+}
+
+
+/* Count the entries in a list
+ */
+size_t count_nodes(const struct _node* head) {
+    size_t	count=0;
+
+    for (; head; head=head->next)
+	count++;
+    ops.steps+=count;
+
+    return count;
+}
+
+
+/* Create an empty index with room for count entries.  The table is kept
+ * at most half full so probe sequences stay short.
+ */
+void index_init(struct _index* index, size_t count) {
+    for (index->size=16; index->size<2*count; index->size*=2)
+	;
+    index->slots=xmalloc(index->size*sizeof(struct _node*));
+    memset(index->slots, 0, index->size*sizeof(struct _node*));
+    index->count=0;
+}
+
+
+void index_add(struct _index* index, struct _node* node);
+
+/* Double the size of an index that is getting too full.
+ */
+void index_grow(struct _index* index) {
+    struct _node**	slots=index->slots;
+    size_t		size=index->size;
+    size_t		slot;
+
+    index_init(index, size);
+    for (slot=0; slot<size; slot++)
+	if (slots[slot])
+	    index_add(index, slots[slot]);
+    free(slots);
+}
+
+
+/* Add an entry to an index, unless an entry with the same name is
+ * already present.
+ */
+void index_add(struct _index* index, struct _node* node) {
+    size_t	slot;
+
+    if (2*(index->count+1)>index->size)
+	index_grow(index);
+
+    slot=hash_name(node->name)&(index->size-1);
+    while (index->slots[slot]) {
+	ops.probes++;
+	if (strcmp(index->slots[slot]->name, node->name)==0)
+	    return;
+	slot=(slot+1)&(index->size-1);
+    }
+    index->slots[slot]=node;
+    index->count++;
+}
+
+
+/* Build an index for the entries of a list.
+ */
+void index_build(struct _index* index, struct _node* head) {
+    index_init(index, count_nodes(head));
+
+    for (; head; head=head->next)
+	index_add(index, head);
+}
+
+
+/* Locate an entry with a specific name in an index
+ */
+struct _node* index_lookup(const struct _index* index, const char* name) {
+    size_t	slot;
+
+    slot=hash_name(name)&(index->size-1);
+    ops.probes++;
+    while (index->slots[slot]) {
+	if (strcmp(index->slots[slot]->name, name)==0)
+	    return index->slots[slot];
+	ops.probes++;
+	slot=(slot+1)&(index->size-1);
+    }
+
+    return NULL;
+}
+
+
+/* Remove an entry from an index.  The entries after it in its probe
+ * sequence are moved up where needed, so that lookups still find them.
+ */
+void index_remove(struct _index* index, const struct _node* node) {
+    size_t	mask=index->size-1;
+    size_t	slot;
+    size_t	next;
+    size_t	home;
+
+    slot=hash_name(node->name)&mask;
+    while (index->slots[slot] && index->slots[slot]!=node)
+	slot=(slot+1)&mask;
+    if (index->slots[slot]==NULL)
+	return;
+
+    for (next=(slot+1)&mask; index->slots[next]; next=(next+1)&mask) {
+	home=hash_name(index->slots[next]->name)&mask;
+	/* An entry can fill the hole unless its home slot lies between
+	 * the hole and the entry itself.
+	 */
+	if ((next>slot) ? (home<=slot || home>next) : (home<=slot && home>next)) {
+	    index->slots[slot]=index->slots[next];
+	    slot=next;
+	}
+    }
+    index->slots[slot]=NULL;
+    index->count--;
+}
+
+
+void index_free(struct _index* index) {
+    free(index->slots);
+    index->slots=NULL;
+    index->size=0;
+    index->count=0;
+}
+
+
+/* When reconciling only the changes between two versions of the master
+ * files, the names of the entries that differ between them.  NULL means
+ * all entries are checked.
+ */
+struct _index*	scope_accounts	= NULL;
+struct _index*	scope_groups	= NULL;
+
+
+/* Return the scope for the passes against a master list.
+ */
+const struct _index* scope_of(const struct _node* master) {
+    if (master==master_accounts)
+	return scope_accounts;
+    if (master==master_groups)
+	return scope_groups;
+    return NULL;
+}
+
+
+/* Check whether two versions of a master entry are the same.
+ */
+int same_entry(const struct _node* a, const struct _node* b, int isgroup) {
+    if (isgroup) {
+	char**	ma=GR(a)->gr_mem;
+	char**	mb=GR(b)->gr_mem;
+
+	if (GR(a)->gr_gid!=GR(b)->gr_gid ||
+		strcmp(safestr(GR(a)->gr_passwd), safestr(GR(b)->gr_passwd))!=0)
+	    return 0;
+	for (; *ma && *mb; ma++, mb++)
+	    if (strcmp(*ma, *mb)!=0)
+		return 0;
+	return (*ma==NULL && *mb==NULL);
+    }
+
+    return PW(a)->pw_uid==PW(b)->pw_uid &&
+	PW(a)->pw_gid==PW(b)->pw_gid &&
+	strcmp(safestr(PW(a)->pw_passwd), safestr(PW(b)->pw_passwd))==0 &&
+	strcmp(safestr(PW(a)->pw_gecos), safestr(PW(b)->pw_gecos))==0 &&
+	strcmp(safestr(PW(a)->pw_dir), safestr(PW(b)->pw_dir))==0 &&
+	strcmp(safestr(PW(a)->pw_shell), safestr(PW(b)->pw_shell))==0;
+}
+
+
+/* Build the scope of names that were added, removed or changed between
+ * the previously applied version of a master file and the current one.
+ * Returns the number of such names.
+ */
+size_t build_scope(struct _index* scope, struct _node* old, struct _node* new, int isgroup) {
+    struct _index	old_index;
+    struct _index	new_index;
+    struct _node*	walk;
+
+    index_build(&old_index, old);
+    index_build(&new_index, new);
+    index_init(scope, 0);
+
+    for (walk=old; walk; walk=walk->next)
+	if (index_lookup(&new_index, walk->name)==NULL)
+	    index_add(scope, walk);
+    for (walk=new; walk; walk=walk->next) {
+	struct _node*	oc=index_lookup(&old_index, walk->name);
+
+	if (oc==NULL || !same_entry(oc, walk, isgroup))
+	    index_add(scope, walk);
+    }
+
+    index_free(&old_index);
+    index_free(&new_index);
+
+    return scope->count;
+}
+
+
+/* The result of matching the entries of one list against another by name:
+ * a snapshot of the probed entries in list order, and for each of them the
+ * first entry of the other list with the same name, or NULL.  Because the
+ * snapshot doesn't change, the process_* passes can walk it while they
+ * modify the lists.
+ */
+struct _matches {
+    struct _node**	nodes;
+    struct _node**	match;
+    size_t		count;
+};
+
+/* One shard of a hash-partitioned join.  Shard s gets the entries whose
+ * name hashes to s modulo the number of shards, from both sides, so shards
+ * can be joined independently of each other.
+ */
+struct _shard {
+    struct _node**	build;
+    size_t		nbuild;
+    size_t*		probe;
+    size_t		nprobe;
+    struct _matches*	result;
+    pthread_t		thread;
+    int			threaded;
+    struct _ops		ops;
+};
+
+
+void* join_shard(void* arg) {
+    struct _shard*	shard=arg;
+    struct _index	index;
+    size_t		i;
+
+    index_init(&index, shard->nbuild);
+    for (i=0; i<shard->nbuild; i++)
+	index_add(&index, shard->build[i]);
+
+    for (i=0; i<shard->nprobe; i++) {
+	size_t	pos=shard->probe[i];
+
+	shard->result->match[pos]=index_lookup(&index, shard->result->nodes[pos]->name);
+    }
+
+    index_free(&index);
+    shard->ops=ops;
+    return NULL;
+}
+
+
+/* Match the entries of probe against those of build, leaving out probe
+ * entries whose name is not in scope unless that is NULL.  The entries of both
+ * lists are partitioned by name hash into one shard per job, and the
+ * shards are joined on separate threads.  Since every result goes to the
+ * position of its probe entry, the outcome is the same for any number of
+ * jobs.
+ */
+void match_entries(struct _matches* result, struct _node* probe, struct _node* build, const struct _index* scope) {
+    struct _shard*	shards;
+    struct _node**	build_slots;
+    size_t*		probe_slots;
+    struct _node*	walk;
+    size_t		nshards=opt_jobs;
+    size_t		nbuild=count_nodes(build);
+    size_t		s, i;
+
+    result->count=count_nodes(probe);
+    result->nodes=xmalloc(result->count*sizeof(struct _node*));
+    result->match=xmalloc(result->count*sizeof(struct _node*));
+    for (i=0, walk=probe; walk; walk=walk->next)
+	if (scope==NULL || index_lookup(scope, walk->name))
+	    result->nodes[i++]=walk;
+    result->count=i;
+
+    if (opt_engine==ENGINE_SIMPLE) {
+	for (i=0; i<result->count; i++)
+	    result->match[i]=find_by_named_entry(build, result->nodes[i]);
+	return;
+    }
+
+    /* Small lists aren't worth a thread each */
+    if (result->count+nbuild<1024)
+	nshards=1;
+
+    shards=xmalloc(nshards*sizeof(struct _shard));
+    for (s=0; s<nshards; s++) {
+	shards[s].nbuild=0;
+	shards[s].nprobe=0;
+	shards[s].result=result;
+	shards[s].threaded=0;
+    }
+
+    /* All shards share one array for each side, in which every shard gets
+     * exactly as many slots as it has entries.
+     */
+    for (walk=build; walk; walk=walk->next)
+	shards[hash_name(walk->name)%nshards].nbuild++;
+    for (i=0; i<result->count; i++)
+	shards[hash_name(result->nodes[i]->name)%nshards].nprobe++;
+
+    build_slots=xmalloc((nbuild+1)*sizeof(struct _node*));
+    probe_slots=xmalloc((result->count+1)*sizeof(size_t));
+    for (s=0, nbuild=0, i=0; s<nshards; s++) {
+	shards[s].build=build_slots+nbuild;
+	shards[s].probe=probe_slots+i;
+	nbuild+=shards[s].nbuild;
+	i+=shards[s].nprobe;
+	shards[s].nbuild=0;
+	shards[s].nprobe=0;
+    }
+
+    /* Build entries are distributed in list order, so within a shard the
+     * first entry with a given name still wins.
+     */
+    for (walk=build; walk; walk=walk->next) {
+	s=hash_name(walk->name)%nshards;
+	shards[s].build[shards[s].nbuild++]=walk;
+    }
+    for (i=0; i<result->count; i++) {
+	s=hash_name(result->nodes[i]->name)%nshards;
+	shards[s].probe[shards[s].nprobe++]=i;
+    }
+
+    for (s=1; s<nshards; s++)
+	if (pthread_create(&shards[s].thread, NULL, join_shard, &shards[s])==0)
+	    shards[s].threaded=1;
+    for (s=0; s<nshards; s++)
+	if (!shards[s].threaded)
+	    join_shard(&shards[s]);
+
+    for (s=0; s<nshards; s++) {
+	if (shards[s].threaded) {
+	    pthread_join(shards[s].thread, NULL);
+	    merge_ops(&shards[s].ops);
+	}
+    }
+    free(build_slots);
+    free(probe_slots);
+    free(shards);
+}
+
+
+void matches_free(struct _matches* result) {
+    free(result->nodes);
+    free(result->match);
+}
+
+
 /* Function to scan the list of special users or groups to see if a an
  * entry has a certain flag set.
  */
@@ -429,17 +1153,15 @@ int read_passwd(struct _node** list, const char* file) {
     }
 
     while ((result=fgetpwent(input))!=NULL) {
-	node=create_node();
-	copy_passwd(node, result);
-	node->t=t_passwd;
-	node->name=node->d.pw.pw_name;
+	node=new_passwd_node(result);
 	if (!node->name)
 	    break;
 	if (node->name[0]=='+')
 	    node->id=0;
 	else
-	    node->id=node->d.pw.pw_uid;
+	    node->id=PW(node)->pw_uid;
 	add_node(list, node, 0);
+	ops.parsed++;
     }
 
     if ((result==NULL) && (errno!=ENOENT)) {
@@ -468,17 +1190,15 @@ int read_group(struct _node** list, const char* file) {
     }
 
     while ((result=fgetgrent(input))!=NULL) {
-	node=create_node();
-	copy_group(node, result);
-	node->t=t_group;
-	node->name=node->d.gr.gr_name;
+	node=new_group_node(result);
 	if (!node->name)
 	    break;
 	if (node->name[0]=='+')
 	    node->id=0;
 	else
-	    node->id=node->d.gr.gr_gid;
+	    node->id=GR(node)->gr_gid;
 	add_node(list, node, 0);
+	ops.parsed++;
     }
 
     if ((result==NULL) && (errno!=ENOENT)) {
@@ -508,14 +1228,11 @@ int read_shadow(struct _node** list, const char* file) {
     }
 
     while ((result=fgetspent(input))!=NULL) {
-	node=create_node();
-	copy_shadow(node, result);
-	node->t=t_shadow;
-	node->id=0;
-	node->name=node->d.sp.sp_namp;
+	node=new_spwd_node(result);
 	if (!node->name)
 	    break;
 	add_node(list, node, 0);
+	ops.parsed++;
     }
 
     if ((result==NULL) && (errno!=ENOENT)) {
@@ -529,16 +1246,6 @@ int read_shadow(struct _node** list, const char* file) {
 }
 
 
-/* Small helper functions to safely print strings that might be NULL.
- */
-const char* safestr(const char* str) {
-    if (str==NULL)
-	return "";
-    else
-	return str;
-}
-
-
 /* Implement our own putpwent(3). The version in GNU libc is stupid enough
  * to not recognize NIS compat entries and will happily turn an entry like
  * this:
@@ -584,6 +1291,7 @@ int fputpwent(const struct passwd *passwd, FILE * f) {
 void usage() {
     printf(
 	"Usage: update-passwd [OPTION]...\n"
+	"       update-passwd --diff=passwd|group [--json] OLD NEW\n"
 	"\n"
 	"  -p, --passwd-master=file  Use file as the master account list\n"
 	"  -g, --group-master=file   Use file as the master group list\n"
@@ -594,6 +1302,36 @@ void usage() {
 	"  -v, --verbose             Show details about what we are doing (recommended)\n"
 	"  -n, --dry-run             Just say what we would do but do nothing\n"
 	"  -L, --no-locking          Don't try to lock files\n"
+	"      --pipeline            Prefetch passwd and write the system files on\n"
+	"                            threads of their own\n"
+	"      --background          Run at idle priority outside the locked section\n"
+	"      --jobs=N              Compare entries on N threads (0: one per CPU)\n"
+	"      --engine=ENGINE       Match entries with the auto, simple, indexed or\n"
+	"                            parallel engine\n"
+	"      --stats               Report counters and timings when done\n"
+	"      --state-dir=DIR       Only check what changed since the masters saved in DIR\n"
+	"      --full-check          Check all entries even with --state-dir\n"
+	"      --populate            Create missing system files from the master files\n"
+	"      --sysusers[=DIR]      Also create users and groups from sysusers.d\n"
+	"      --extra-set=P:G       Also check passwd file P and group file G\n"
+	"      --extra-set=DIR       Also check DIR/passwd and DIR/group\n"
+	"      --diff=TYPE           Compare two passwd or group files field by field\n"
+	"      --json                Report --diff edits as JSON, one per line\n"
+	"      --anonymize=DIR       Write pseudonymized copies of the system files to DIR\n"
+	"      --bulk=FILE           Apply the account changes listed in FILE\n"
+	"      --member-policy=[GROUP:]POLICY\n"
+	"                            Keep, add or exactly match master group members\n"
+	"      --hot-entries         Put the entries from the master files first\n"
+	"      --subids[=DIR]        Keep DIR/subuid and DIR/subgid in line with the\n"
+	"                            accounts (default: /etc)\n"
+	"      --subid-users=FIRST-LAST\n"
+	"                            Give new users with these uids subordinate ids\n"
+	"                            (default: 1000-60000)\n"
+	"      --check-paths         Check that home directories and shells exist\n"
+	"      --chown-tree=DIR      Give files in DIR the new ids of renumbered entries\n"
+	"      --lock-file=FILE      Lock FILE instead of the system lock file\n"
+	"      --log-format=FORMAT   Report decisions as text or jsonl records\n"
+	"      --log-fd=N            Write jsonl records to file descriptor N\n"
 	"  -h, --help                Display this information and exit\n"
 	"  -V, --version             Show version number and exit\n"
 	"\n"
@@ -616,30 +1354,142 @@ void version() {
 }
 
 
-/* Assuming that we've already queued up a debconf question using REGISTER and
- * any necessary SUBST, ask the question and return the answer as a boolean
- * flag.  Aborts the problem on any failure.
+/* The template and substitutions of the question being prepared */
+#define MAX_DEBCONF_SUBSTS	8
+
+struct _pending {
+    char*	template;
+    char*	vars[MAX_DEBCONF_SUBSTS];
+    char*	values[MAX_DEBCONF_SUBSTS];
+    int		count;
+} pending;
+
+/* An answer given during this run, keyed by question */
+struct _answer {
+    struct _node	n;
+    int			answer;
+};
+
+struct _index	debconf_answers;
+
+
+void prepare_debconf(const char* template) {
+    pending.template=xstrdup(template);
+    pending.count=0;
+}
+
+
+void prepare_debconf_subst(const char* var, const char* value) {
+    if (pending.count==MAX_DEBCONF_SUBSTS) {
+	fprintf(stderr, "Internal error: too many debconf substitutions\n");
+	exit(1);
+    }
+    pending.vars[pending.count]=xstrdup(var);
+    pending.values[pending.count]=xstrdup(value);
+    pending.count++;
+}
+
+
+/* Forget the question that was being prepared.
+ */
+void clear_pending() {
+    int		i;
+
+    for (i=0; i<pending.count; i++) {
+	free(pending.vars[i]);
+	free(pending.values[i]);
+    }
+    free(pending.template);
+    pending.template=NULL;
+    pending.count=0;
+}
+
+
+/* Find the answer to a question without showing it, either because it
+ * was already asked during this run, or because it has been seen before
+ * and debconf remembers the answer.  A previously declined change then
+ * costs two round trips instead of one for every REGISTER, SUBST, INPUT
+ * and GET.  dpkg-reconfigure sets DEBCONF_RECONFIGURE to show seen
+ * questions again, so we don't look at the seen flag then.  Returns 1 if
+ * the answer is known.
+ */
+int recall_debconf(const char* question, int* answer) {
+    const struct _answer*	known;
+    const char*			response;
+
+    if ((known=(const struct _answer*)index_lookup(&debconf_answers, question))!=NULL) {
+	*answer=known->answer;
+	return 1;
+    }
+
+    if (getenv("DEBCONF_RECONFIGURE")!=NULL)
+	return 0;
+
+    /* This fails for questions that were never registered */
+    if (DEBCONF_TIMED(debconf_fget(debconf, question, "seen"))!=0)
+	return 0;
+    response=debconf->ret(debconf);
+    if (response==NULL || strcmp(response, "true")!=0)
+	return 0;
+
+    DEBCONF_CHECK(debconf_get(debconf, question));
+    response=debconf->ret(debconf);
+    *answer=(response!=NULL && strcmp(response, "true")==0);
+    return 1;
+}
+
+
+/* Remember the answer to a question for the rest of this run.
+ */
+void remember_answer(const char* question, int answer) {
+    struct _answer*	known=xmalloc(sizeof(struct _answer));
+
+    memset(known, 0, sizeof(struct _answer));
+    known->n.name=xstrdup(question);
+    known->answer=answer;
+    index_add(&debconf_answers, &known->n);
+}
+
+
+/* Assuming that we've already prepared a debconf question using
+ * DEBCONF_REGISTER and any necessary DEBCONF_SUBST, ask the question and
+ * return the answer as a boolean flag.  Answers that are already known
+ * are used without showing the question again.  Aborts the program on any
+ * failure.
  */
 int ask_debconf(const char* priority, const char* question) {
     int		ret;
+    int		answer;
+    int		i;
     const char*	response;
 
-    ret=debconf_input(debconf, priority, question);
+    if (recall_debconf(question, &answer)) {
+	stats.debconf_reused++;
+	clear_pending();
+	return answer;
+    }
+
+    DEBCONF_CHECK(debconf_register(debconf, pending.template, question));
+    for (i=0; i<pending.count; i++)
+	DEBCONF_CHECK(debconf_subst(debconf, question, pending.vars[i], pending.values[i]));
+    clear_pending();
+
+    ret=DEBCONF_TIMED(debconf_input(debconf, priority, question));
     if (ret==0)
-	ret=debconf_go(debconf);
+	ret=DEBCONF_TIMED(debconf_go(debconf));
     else if (ret==30)
 	ret=0;
     if (ret==0)
-	ret=debconf_get(debconf, question);
+	ret=DEBCONF_TIMED(debconf_get(debconf, question));
     if (ret!=0) {
 	fprintf(stderr, "Debconf interaction failed\n");
 	exit(1);
     }
     response=debconf->ret(debconf);
-    if (response!=NULL && strcmp(response, "true")==0)
-	return 1;
-    else
-	return 0;
+    answer=(response!=NULL && strcmp(response, "true")==0);
+    remember_answer(question, answer);
+
+    return answer;
 }
 
 
@@ -660,21 +1510,107 @@ char* escape_debconf(const char* string) {
 }
 
 
+/* Write a string as a JSON string literal.
+ */
+void fputjson(const char* str, FILE* f) {
+    putc('"', f);
+    for (str=safestr(str); *str; str++) {
+	unsigned char	c=*str;
+
+	if (c=='"' || c=='\\')
+	    fprintf(f, "\\%c", c);
+	else if (c<0x20)
+	    fprintf(f, "\\u%04x", c);
+	else
+	    putc(c, f);
+    }
+    putc('"', f);
+}
+
+
+/* Start the decision log requested with --log-format=jsonl.  Records
+ * are collected in one large stdio buffer, so that even runs with tens of
+ * thousands of decisions cost only a handful of writes.
+ */
+int open_log() {
+    int		fd=opt_logfd;
+
+    /* The log takes over stdout, and everything else we print goes to
+     * stderr, so that the log can be parsed.
+     */
+    if (fd==STDOUT_FILENO) {
+	fflush(stdout);
+	if ((fd=dup(STDOUT_FILENO))==-1 || dup2(STDERR_FILENO, STDOUT_FILENO)==-1) {
+	    fprintf(stderr, "Can't move stdout out of the way of the log: %s\n", strerror(errno));
+	    return 0;
+	}
+    }
+
+    if ((log_stream=fdopen(fd, "w"))==NULL) {
+	fprintf(stderr, "Can't open file descriptor %d for the log: %s\n", fd, strerror(errno));
+	return 0;
+    }
+
+    setvbuf(log_stream, NULL, _IOFBF, LOG_BUFFER_SIZE);
+    return 1;
+}
+
+
+/* Record a decision in the log, if there is one.  Old and new values are
+ * written as strings, and as null where they don't apply.
+ */
+void log_decision(const char* kind, const struct _node* node, const char* old, const char* new, int approved) {
+    if (log_stream==NULL)
+	return;
+
+    fputs("{\"kind\":", log_stream);
+    fputjson(kind, log_stream);
+    fputs(",\"name\":", log_stream);
+    fputjson(node->name, log_stream);
+    fprintf(log_stream, ",\"id\":%u,\"old\":", node->id);
+    if (old)
+	fputjson(old, log_stream);
+    else
+	fputs("null", log_stream);
+    fputs(",\"new\":", log_stream);
+    if (new)
+	fputjson(new, log_stream);
+    else
+	fputs("null", log_stream);
+    fprintf(log_stream, ",\"approved\":%s}\n", approved ? "true" : "false");
+}
+
+
+/* As log_decision, for changes of numeric ids.
+ */
+void log_id_decision(const char* kind, const struct _node* node, unsigned old, unsigned new, int approved) {
+    char	oldstr[16];
+    char	newstr[16];
+
+    if (log_stream==NULL)
+	return;
+
+    snprintf(oldstr, sizeof(oldstr), "%u", old);
+    snprintf(newstr, sizeof(newstr), "%u", new);
+    log_decision(kind, node, oldstr, newstr, approved);
+}
+
+
 /* Check if we need to move any master file entries above NIS compat
  * switching entries ("+").
  */
 void process_moved_entries(const struct _info* lst, struct _node** passwd, struct _node* master, const char* descr) {
-    struct _node*	walk=*passwd;
+    struct _node*	plus=find_by_name(*passwd, "+");
+    struct _node*	walk;
+    struct _matches	m;
+    size_t		i;
 
-    while (walk) {
-	if (strcmp(walk->name, "+")==0) {
-	    walk=walk->next;
-	    break;
-	}
-	walk=walk->next;
-    }
-    while (walk) {
-	if (find_by_named_entry(master, walk)) {
+    if (plus==NULL)
+	return;
+    match_entries(&m, plus->next, master, scope_of(master));
+    for (i=0; i<m.count; i++) {
+	walk=m.nodes[i];
+	if (m.match[i]) {
 	    if (!noautoadd(lst, walk->id)) {
 		struct _node*	movednode=walk;
 		int		make_change=1;
@@ -699,37 +1635,40 @@ void process_moved_entries(const struct _info* lst, struct _node** passwd, struc
 		    free(id);
 		}
 
+		log_decision(strcmp(descr, "group")==0 ? "group-move" : "user-move", movednode, NULL, NULL, make_change);
 		if (make_change) {
-		    if (opt_verbose)
+		    if (opt_verbose && !log_stream)
 			printf("Moving %s \"%s\" (%u) to before \"+\" entry\n", descr, movednode->name, movednode->id);
 		    remove_node(passwd, movednode);
-		    add_node(passwd, movednode, 1);
+		    insert_node(passwd, movednode, plus);
 		    flag_dirty++;
 		}
-
-		walk=walk->next;
-		continue;
 	    }
 	}
-	walk=walk->next;
     }
+    matches_free(&m);
 }
 
 
-/* Check if new accounts should be made on the system. Please note we don't
- * add accounts to shadow here; those will be made automatically at a later
- * stage where we verify the contents of the shadow database
+/* Check if new accounts should be made on the system, and put the master
+ * entries to add in CHOSEN.  The typed process_new_<type> passes copy
+ * them in front of the NIS compat entry.  Please note we don't add
+ * accounts to shadow here; those will be made at a later stage by
+ * sync_shadow, which only reads the shadow database if accounts were added
+ * or removed.
  */
-void process_new_entries(const struct _info* lst, struct _node** passwd, struct _node* master, const char* descr) {
-    while (master) {
-	if (find_by_named_entry(*passwd, master)==NULL) {
-	    struct _node*	newnode;
+void choose_new_entries(const struct _info* lst, struct _node* passwd, struct _node* master, const char* descr, struct _nodelist* chosen) {
+    struct _matches	m;
+    size_t		i;
+
+    match_entries(&m, master, passwd, scope_of(master));
+    for (i=0; i<m.count; i++) {
+	master=m.nodes[i];
+	if (m.match[i]==NULL) {
 	    int			make_change=1;
 
-	    if (noautoadd(lst, master->id)) {
-		master=master->next;
+	    if (noautoadd(lst, master->id))
 		continue;
-	    }
 
 	    if (flag_debconf) {
 		char*		question;
@@ -751,38 +1690,40 @@ void process_new_entries(const struct _info* lst, struct _node** passwd, struct
 		free(id);
 	    }
 
+	    log_decision(strcmp(descr, "group")==0 ? "group-add" : "user-add", master, NULL, NULL, make_change);
 	    if (make_change) {
-		if (opt_verbose)
+		if (opt_verbose && !log_stream)
 		    printf("Adding %s \"%s\" (%u)\n", descr, master->name, master->id);
-		newnode=copy_node(master);
-		add_node(passwd, newnode, 1);
+		nodelist_append(chosen, master);
 		flag_dirty++;
 	    }
 	}
-	master=master->next;
     }
+    matches_free(&m);
 }
 
 
-/* Check if accounts should be removed. Like with process_new_accounts we
- * don't update shadow here since it is verified at a later stage anyway.
- * We will only remove accounts in our range (uids 0-99).
+/* Check if accounts should be removed, and put the entries to remove in
+ * CHOSEN for the typed process_old_<type> passes.  Like with
+ * choose_new_entries we don't update shadow here since it is verified at a
+ * later stage anyway.  We will only remove accounts in our range (uids
+ * 0-99).
  */
-void process_old_entries(const struct _info* lst, struct _node** passwd, struct _node* master, const char* descr) {
-    struct _node*	walk=*passwd;
-
-    while (walk) {
-	if ((walk->id<0) || (walk->id>99)) {
-	    walk=walk->next;
+void choose_old_entries(const struct _info* lst, struct _node* passwd, struct _node* master, const char* descr, struct _nodelist* chosen) {
+    struct _node*	walk;
+    struct _matches	m;
+    size_t		i;
+
+    match_entries(&m, passwd, master, scope_of(master));
+    for (i=0; i<m.count; i++) {
+	walk=m.nodes[i];
+	if ((walk->id<0) || (walk->id>99))
 	    continue;
-	}
 
-	if (noautoremove(lst, walk->id)) {
-	    walk=walk->next;
+	if (noautoremove(lst, walk->id))
 	    continue;
-	}
 
-	if (find_by_named_entry(master, walk)==NULL) {
+	if (m.match[i]==NULL) {
 	    struct _node*	oldnode=walk;
 	    int			make_change=1;
 
@@ -806,24 +1747,57 @@ void process_old_entries(const struct _info* lst, struct _node** passwd, struct
 		free(id);
 	    }
 
+	    log_decision(strcmp(descr, "group")==0 ? "group-remove" : "user-remove", oldnode, NULL, NULL, make_change);
 	    if (make_change) {
-		if (opt_verbose)
+		if (opt_verbose && !log_stream)
 		    printf("Removing %s \"%s\" (%u)\n", descr, oldnode->name, oldnode->id);
-		remove_node(passwd, oldnode);
+		nodelist_append(chosen, oldnode);
 		flag_dirty++;
 	    }
-	    walk=walk->next;
-	    continue;
 	}
-	walk=walk->next;
     }
+    matches_free(&m);
+}
+
+
+/* Entries of the system files whose id was changed, with their old ids */
+struct _renumbering {
+    const struct _node*	node;
+    uid_t		old_id;
+};
+
+struct _renumberings {
+    struct _renumbering*	entries;
+    size_t			count;
+};
+
+struct _renumberings	renumbered_users;
+struct _renumberings	renumbered_groups;
+
+
+/* Remember that an entry of the system files changed its id.
+ */
+void note_renumbered(struct _renumberings* list, const struct _node* node, uid_t old_id) {
+    list->entries=realloc(list->entries, (list->count+1)*sizeof(struct _renumbering));
+    if (list->entries==NULL) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    list->entries[list->count].node=node;
+    list->entries[list->count].old_id=old_id;
+    list->count++;
 }
 
 
 /* Check if account-information needs to be updated.
  */
 void process_changed_accounts(struct _node* passwd, struct _node* group, struct _node* master) {
-    for (;passwd; passwd=passwd->next) {
+    struct _matches	m;
+    size_t		i;
+    int			system=(passwd==system_accounts);
+
+    match_entries(&m, passwd, master, scope_of(master));
+    for (i=0; i<m.count; i++) {
 	struct _node*	mc;	/* mastercopy of this account */
 	char*		question;
 	char*		old_id;
@@ -832,10 +1806,11 @@ void process_changed_accounts(struct _node* passwd, struct _node* group, struct
 	char*		newpart;
 	int		make_change;
 
+	passwd=m.nodes[i];
 	if (((passwd->id<0) || (passwd->id>99)) && (passwd->id!=65534))
 	    continue;
 
-	mc=find_by_named_entry(master, passwd);
+	mc=m.match[i];
 	if (mc==NULL) 
 	    continue;
 
@@ -855,26 +1830,29 @@ void process_changed_accounts(struct _node* passwd, struct _node* group, struct
 		free(new_id);
 	    }
 
+	    log_id_decision("user-change-uid", passwd, passwd->id, mc->id, make_change);
 	    if (make_change) {
-		if (opt_verbose)
+		if (opt_verbose && !log_stream)
 		    printf("Changing uid of %s from %u to %u\n", passwd->name, passwd->id, mc->id);
+		if (system)
+		    note_renumbered(&renumbered_users, passwd, passwd->id);
 		passwd->id=mc->id;
-		passwd->d.pw.pw_uid=mc->d.pw.pw_uid;
+		PW(passwd)->pw_uid=PW(mc)->pw_uid;
 		flag_dirty++;
 	    }
 	}
 
-	if (passwd->d.pw.pw_gid!=mc->d.pw.pw_gid) {
-	    const struct _node* oldentry = find_by_id(group, passwd->d.pw.pw_gid);
-	    const struct _node* newentry = find_by_id(group, mc->d.pw.pw_gid);
+	if (PW(passwd)->pw_gid!=PW(mc)->pw_gid) {
+	    const struct _node* oldentry = find_by_id(group, PW(passwd)->pw_gid);
+	    const struct _node* newentry = find_by_id(group, PW(mc)->pw_gid);
 	    const char* oldname = oldentry ? oldentry->name : "ABSENT";
 	    const char* newname = newentry ? newentry->name : "ABSENT";
 
 	    make_change=1;
 	    if (flag_debconf) {
-		question=xasprintf("base-passwd/%s/user/%s/gid/%u/%u", user_domain, passwd->name, passwd->d.pw.pw_gid, mc->d.pw.pw_gid);
-		old_id=xasprintf("%u", passwd->d.pw.pw_gid);
-		new_id=xasprintf("%u", mc->d.pw.pw_gid);
+		question=xasprintf("base-passwd/%s/user/%s/gid/%u/%u", user_domain, passwd->name, PW(passwd)->pw_gid, PW(mc)->pw_gid);
+		old_id=xasprintf("%u", PW(passwd)->pw_gid);
+		new_id=xasprintf("%u", PW(mc)->pw_gid);
 		DEBCONF_REGISTER("base-passwd/user-change-gid", question);
 		DEBCONF_SUBST(question, "name", passwd->name);
 		DEBCONF_SUBST(question, "old_gid", old_id);
@@ -887,17 +1865,18 @@ void process_changed_accounts(struct _node* passwd, struct _node* group, struct
 		free(new_id);
 	    }
 
+	    log_id_decision("user-change-gid", passwd, PW(passwd)->pw_gid, PW(mc)->pw_gid, make_change);
 	    if (make_change) {
-		if (opt_verbose)
-		    printf("Changing gid of %s from %u (%s) to %u (%s)\n", passwd->name, passwd->d.pw.pw_gid, oldname, mc->d.pw.pw_gid, newname);
-		passwd->d.pw.pw_gid=mc->d.pw.pw_gid;
+		if (opt_verbose && !log_stream)
+		    printf("Changing gid of %s from %u (%s) to %u (%s)\n", passwd->name, PW(passwd)->pw_gid, oldname, PW(mc)->pw_gid, newname);
+		PW(passwd)->pw_gid=PW(mc)->pw_gid;
 		flag_dirty++;
 	    }
 	}
 
 	if (!keepgecos(specialusers, passwd->id))
-	    if ((passwd->d.pw.pw_gecos==NULL) || (strcmp(passwd->d.pw.pw_gecos, mc->d.pw.pw_gecos)!=0)) {
-		const char *oldgecos = passwd->d.pw.pw_gecos ? passwd->d.pw.pw_gecos : "";
+	    if ((PW(passwd)->pw_gecos==NULL) || (strcmp(PW(passwd)->pw_gecos, PW(mc)->pw_gecos)!=0)) {
+		const char *oldgecos = PW(passwd)->pw_gecos ? PW(passwd)->pw_gecos : "";
 
 		make_change=1;
 		if (flag_debconf) {
@@ -905,98 +1884,383 @@ void process_changed_accounts(struct _node* passwd, struct _node* group, struct
 		    DEBCONF_REGISTER("base-passwd/user-change-gecos", question);
 		    DEBCONF_SUBST(question, "name", passwd->name);
 		    DEBCONF_SUBST(question, "old_gecos", oldgecos);
-		    DEBCONF_SUBST(question, "new_gecos", mc->d.pw.pw_gecos);
+		    DEBCONF_SUBST(question, "new_gecos", PW(mc)->pw_gecos);
 		    make_change=ask_debconf("low", question);
 		    free(question);
 		}
 
+		log_decision("user-change-gecos", passwd, PW(passwd)->pw_gecos, PW(mc)->pw_gecos, make_change);
 		if (make_change) {
-		    if (opt_verbose)
-			printf("Changing GECOS of %s from \"%s\" to \"%s\".\n", passwd->name, oldgecos, mc->d.pw.pw_gecos);
+		    if (opt_verbose && !log_stream)
+			printf("Changing GECOS of %s from \"%s\" to \"%s\".\n", passwd->name, oldgecos, PW(mc)->pw_gecos);
 		    /* We update the pw_gecos entry of passwd so it now points into the
 		     * buffer from mc. This is safe for us, since we know we won't free
 		     * the data in mc until after we are done.
 		     */
-		    passwd->d.pw.pw_gecos=mc->d.pw.pw_gecos;
+		    PW(passwd)->pw_gecos=PW(mc)->pw_gecos;
 		    flag_dirty++;
 		}
 	    }
 
 	if (!keephome(specialusers, passwd->id))
-	    if ((passwd->d.pw.pw_dir==NULL) || (strcmp(passwd->d.pw.pw_dir, mc->d.pw.pw_dir)!=0)) {
-		const char *olddir = passwd->d.pw.pw_dir ? passwd->d.pw.pw_dir : "(none)";
+	    if ((PW(passwd)->pw_dir==NULL) || (strcmp(PW(passwd)->pw_dir, PW(mc)->pw_dir)!=0)) {
+		const char *olddir = PW(passwd)->pw_dir ? PW(passwd)->pw_dir : "(none)";
 
 		make_change=1;
 		if (flag_debconf) {
 		    oldpart=escape_debconf(olddir);
-		    newpart=escape_debconf(mc->d.pw.pw_dir);
+		    newpart=escape_debconf(PW(mc)->pw_dir);
 		    question=xasprintf("base-passwd/%s/user/%s/home/%s/%s", user_domain, passwd->name, oldpart, newpart);
 		    free(oldpart);
 		    free(newpart);
 		    DEBCONF_REGISTER("base-passwd/user-change-home", question);
 		    DEBCONF_SUBST(question, "name", passwd->name);
 		    DEBCONF_SUBST(question, "old_home", olddir);
-		    DEBCONF_SUBST(question, "new_home", mc->d.pw.pw_dir);
+		    DEBCONF_SUBST(question, "new_home", PW(mc)->pw_dir);
 		    make_change=ask_debconf("high", question);
 		    free(question);
 		}
 
+		log_decision("user-change-home", passwd, PW(passwd)->pw_dir, PW(mc)->pw_dir, make_change);
 		if (make_change) {
-		    if (opt_verbose)
-			printf("Changing home-directory of %s from %s to %s\n", passwd->name, olddir, mc->d.pw.pw_dir);
+		    if (opt_verbose && !log_stream)
+			printf("Changing home-directory of %s from %s to %s\n", passwd->name, olddir, PW(mc)->pw_dir);
 		    /* We update the pw_dir entry of passwd so it now points into the
 		     * buffer from mc. This is safe for us, since we know we won't free
 		     * the data in mc until after we are done.
 		     */
-		    passwd->d.pw.pw_dir=mc->d.pw.pw_dir;
+		    PW(passwd)->pw_dir=PW(mc)->pw_dir;
 		    flag_dirty++;
 		}
 	    }
 
 	if (!keepshell(specialusers, passwd->id))
-	    if ((passwd->d.pw.pw_shell==NULL) || (strcmp(passwd->d.pw.pw_shell, mc->d.pw.pw_shell)!=0)) {
-		const char *oldshell = passwd->d.pw.pw_shell ? passwd->d.pw.pw_shell : "(none)";
+	    if ((PW(passwd)->pw_shell==NULL) || (strcmp(PW(passwd)->pw_shell, PW(mc)->pw_shell)!=0)) {
+		const char *oldshell = PW(passwd)->pw_shell ? PW(passwd)->pw_shell : "(none)";
 
 		make_change=1;
 		if (flag_debconf) {
 		    oldpart=escape_debconf(oldshell);
-		    newpart=escape_debconf(mc->d.pw.pw_shell);
+		    newpart=escape_debconf(PW(mc)->pw_shell);
 		    question=xasprintf("base-passwd/%s/user/%s/shell/%s/%s", user_domain, passwd->name, oldpart, newpart);
 		    free(oldpart);
 		    free(newpart);
 		    DEBCONF_REGISTER("base-passwd/user-change-shell", question);
 		    DEBCONF_SUBST(question, "name", passwd->name);
 		    DEBCONF_SUBST(question, "old_shell", oldshell);
-		    DEBCONF_SUBST(question, "new_shell", mc->d.pw.pw_shell);
+		    DEBCONF_SUBST(question, "new_shell", PW(mc)->pw_shell);
 		    make_change=ask_debconf("medium", question);
 		    free(question);
 		}
 
+		log_decision("user-change-shell", passwd, PW(passwd)->pw_shell, PW(mc)->pw_shell, make_change);
 		if (make_change) {
-		    if (opt_verbose)
-			printf("Changing shell of %s from %s to %s\n", passwd->name, oldshell, mc->d.pw.pw_shell);
+		    if (opt_verbose && !log_stream)
+			printf("Changing shell of %s from %s to %s\n", passwd->name, oldshell, PW(mc)->pw_shell);
 		    /* We update the pw_shell entry of passwd so it now points into the
 		     * buffer from mc. This is safe for us, since we know we won't free
 		     * the data in mc until after we are done.
 		     */
-		    passwd->d.pw.pw_shell=mc->d.pw.pw_shell;
+		    PW(passwd)->pw_shell=PW(mc)->pw_shell;
 		    flag_dirty++;
 		}
 	    }
     }
+    matches_free(&m);
+}
+
+
+/* An account with its primary gid as it was before any renumbering */
+struct _gidref {
+    gid_t		gid;
+    struct _node*	account;
+};
+
+
+int compare_gidrefs(const void* a, const void* b) {
+    gid_t	x=((const struct _gidref*)a)->gid;
+    gid_t	y=((const struct _gidref*)b)->gid;
+
+    return (x>y)-(x<y);
+}
+
+
+/* Move the users whose primary group was renumbered along with it.  The
+ * accounts are sorted by their original gid once, so that each renumbered
+ * group only needs a binary search instead of a pass over passwd.  The
+ * keys are copied, so that changing an account can't disturb the search
+ * for a later group, and a swap of two gids moves each user only once.
+ */
+void propagate_gids() {
+    struct _gidref*	refs;
+    struct _node*	walk;
+    size_t		count=0;
+    size_t		r;
+
+    if (renumbered_groups.count==0)
+	return;
+
+    refs=xmalloc(count_nodes(system_accounts)*sizeof(struct _gidref));
+    for (walk=system_accounts; walk; walk=walk->next)
+	if (walk->name[0]!='+' && walk->name[0]!='-') {
+	    refs[count].gid=PW(walk)->pw_gid;
+	    refs[count].account=walk;
+	    count++;
+	}
+    qsort(refs, count, sizeof(struct _gidref), compare_gidrefs);
+
+    for (r=0; r<renumbered_groups.count; r++) {
+	const struct _node*	group=renumbered_groups.entries[r].node;
+	gid_t			old_gid=renumbered_groups.entries[r].old_id;
+	size_t			lo=0;
+	size_t			hi=count;
+
+	while (lo<hi) {
+	    size_t	mid=lo+(hi-lo)/2;
+
+	    ops.probes++;
+	    if (refs[mid].gid<old_gid)
+		lo=mid+1;
+	    else
+		hi=mid;
+	}
+
+	for (; lo<count && refs[lo].gid==old_gid; lo++) {
+	    struct _node*	account=refs[lo].account;
+	    int			make_change=1;
+
+	    ops.steps++;
+	    if (PW(account)->pw_gid!=old_gid)
+		continue;
+
+	    if (flag_debconf) {
+		char*	question;
+		char*	old_id;
+		char*	new_id;
+
+		question=xasprintf("base-passwd/%s/user/%s/gid/%u/%u", user_domain, account->name, old_gid, group->id);
+		old_id=xasprintf("%u", old_gid);
+		new_id=xasprintf("%u", group->id);
+		DEBCONF_REGISTER("base-passwd/user-change-gid", question);
+		DEBCONF_SUBST(question, "name", account->name);
+		DEBCONF_SUBST(question, "old_gid", old_id);
+		DEBCONF_SUBST(question, "old_group", group->name);
+		DEBCONF_SUBST(question, "new_gid", new_id);
+		DEBCONF_SUBST(question, "new_group", group->name);
+		make_change=ask_debconf("high", question);
+		free(question);
+		free(old_id);
+		free(new_id);
+	    }
+
+	    log_id_decision("user-change-gid", account, old_gid, group->id, make_change);
+	    if (make_change) {
+		if (opt_verbose && !log_stream)
+		    printf("Changing gid of %s from %u to %u (%s)\n", account->name, old_gid, group->id, group->name);
+		PW(account)->pw_gid=group->id;
+		flag_dirty++;
+	    }
+	}
+    }
+
+    free(refs);
+}
+
+
+char* join_members(char** members);
+
+/* How the members of a managed group are brought in line with the master
+ * file: not at all, by adding missing members, or by also removing
+ * members the master file doesn't list.
+ */
+enum {
+    MEMBERS_KEEP,
+    MEMBERS_ADD,
+    MEMBERS_EXACT
+};
+
+const char* member_policy_names[] = { "keep", "add", "exact", NULL };
+
+/* A membership policy for one group, or for all groups without one */
+struct _member_policy {
+    const char*	group;		/* NULL for the default */
+    int		policy;
+};
+
+struct _member_policy*	member_policies	= NULL;
+int			member_policy_count = 0;
+
+/* Find the membership policy for a group.  A policy for the group itself
+ * beats the default; of several policies for the group, or several
+ * defaults, the one given last wins.
+ */
+int member_policy(const char* group) {
+    int		policy=MEMBERS_KEEP;
+    int		own=-1;
+    int		i;
+
+    for (i=0; i<member_policy_count; i++)
+	if (member_policies[i].group==NULL)
+	    policy=member_policies[i].policy;
+	else if (strcmp(member_policies[i].group, group)==0)
+	    own=member_policies[i].policy;
+
+    return (own>=0) ? own : policy;
+}
+
+
+/* Wrap the names of a member list in nodes, so they can be put in an
+ * index.  Returns newly allocated memory.
+ */
+struct _node* member_nodes(char** list, size_t* count) {
+    struct _node*	nodes;
+    size_t		i;
+
+    for (*count=0; list[*count]; (*count)++)
+	;
+    nodes=xmalloc((*count+1)*sizeof(struct _node));
+    memset(nodes, 0, (*count+1)*sizeof(struct _node));
+    for (i=0; i<*count; i++)
+	nodes[i].name=list[i];
+
+    return nodes;
+}
+
+
+/* Record a member joining or leaving a group in the log.
+ */
+void log_member(const struct _node* group, const char* user, int added) {
+    if (added)
+	log_decision("group-add-member", group, NULL, user, 1);
+    else
+	log_decision("group-remove-member", group, user, NULL, 1);
+}
+
+
+/* Record every member that is in only one of two member lists of a group
+ * in the log.
+ */
+void log_member_changes(const struct _node* group, char** old, char** new) {
+    struct _node*	old_nodes;
+    struct _node*	new_nodes;
+    struct _index	old_index;
+    struct _index	new_index;
+    size_t		nold;
+    size_t		nnew;
+    size_t		i;
+
+    if (log_stream==NULL)
+	return;
+
+    old_nodes=member_nodes(old, &nold);
+    new_nodes=member_nodes(new, &nnew);
+    index_init(&old_index, nold);
+    index_init(&new_index, nnew);
+    for (i=0; i<nold; i++)
+	index_add(&old_index, &old_nodes[i]);
+    for (i=0; i<nnew; i++)
+	index_add(&new_index, &new_nodes[i]);
+
+    for (i=0; i<nold; i++)
+	if (index_lookup(&new_index, old[i])==NULL) {
+	    log_member(group, old[i], 0);
+	    index_add(&new_index, &old_nodes[i]);
+	}
+    for (i=0; i<nnew; i++)
+	if (index_lookup(&old_index, new[i])==NULL) {
+	    log_member(group, new[i], 1);
+	    index_add(&old_index, &new_nodes[i]);
+	}
+
+    index_free(&old_index);
+    index_free(&new_index);
+    free(old_nodes);
+    free(new_nodes);
+}
+
+
+/* Bring the members of a system group in line with those of its master
+ * entry.  Both member lists are put in an index, so that each member is
+ * checked against the other list with a single lookup.  Existing members
+ * keep their order, and missing ones are appended in the order of the
+ * master file.  Returns 1 if the member list changed.
+ */
+int reconcile_members(struct _node* group, const struct _node* master, int policy) {
+    struct _node*	have;
+    struct _node*	want;
+    struct _index	have_index;
+    struct _index	want_index;
+    size_t		nhave;
+    size_t		nwant;
+    size_t		count=0;
+    size_t		i;
+    char**		members;
+    int			changed=0;
+
+    have=member_nodes(GR(group)->gr_mem, &nhave);
+    want=member_nodes(GR(master)->gr_mem, &nwant);
+    index_init(&have_index, nhave+nwant);
+    index_init(&want_index, nwant);
+    for (i=0; i<nhave; i++)
+	index_add(&have_index, &have[i]);
+    for (i=0; i<nwant; i++)
+	index_add(&want_index, &want[i]);
+
+    members=xmalloc((nhave+nwant+1)*sizeof(char*));
+    for (i=0; i<nhave; i++) {
+	if (policy==MEMBERS_EXACT && index_lookup(&want_index, have[i].name)==NULL) {
+	    if (opt_verbose && !log_stream)
+		printf("Removing user \"%s\" from group \"%s\"\n", have[i].name, group->name);
+	    changed=1;
+	    continue;
+	}
+	members[count++]=(char*)have[i].name;
+    }
+
+    /* Added members go in the index as well, so that a name listed twice
+     * in the master file is only added once.
+     */
+    for (i=0; i<nwant; i++)
+	if (index_lookup(&have_index, want[i].name)==NULL) {
+	    if (opt_verbose && !log_stream)
+		printf("Adding user \"%s\" to group \"%s\"\n", want[i].name, group->name);
+	    index_add(&have_index, &want[i]);
+	    members[count++]=(char*)want[i].name;
+	    changed=1;
+	}
+    members[count]=NULL;
+
+    if (changed) {
+	log_member_changes(group, GR(group)->gr_mem, members);
+	GR(group)->gr_mem=members;
+    } else
+	free(members);
+
+    index_free(&have_index);
+    index_free(&want_index);
+    free(have);
+    free(want);
+    return changed;
 }
 
 
 /* Check if account-information needs to be updated.
  */
 void process_changed_groups(struct _node* group, struct _node* master) {
-    for (;group; group=group->next) {
+    struct _matches	m;
+    size_t		i;
+    int			system=(group==system_groups);
+    int			policy;
+
+    match_entries(&m, group, master, scope_of(master));
+    for (i=0; i<m.count; i++) {
 	struct _node*	mc;	/* mastercopy of this group */
 
+	group=m.nodes[i];
 	if (((group->id<0) || (group->id>99)) && (group->id!=65534))
 	    continue;
 
-	mc=find_by_named_entry(master, group);
+	mc=m.match[i];
 	if (mc==NULL)
 	    continue;
 
@@ -1021,115 +2285,2605 @@ void process_changed_groups(struct _node* group, struct _node* master) {
 		free(new_gid);
 	    }
 
+	    log_id_decision("group-change-gid", group, group->id, mc->id, make_change);
 	    if (make_change) {
-		if (opt_verbose)
+		if (opt_verbose && !log_stream)
 		    printf("Changing gid of %s from %u to %u\n", group->name, group->id, mc->id);
+		if (system)
+		    note_renumbered(&renumbered_groups, group, group->id);
 		group->id=mc->id;
-		group->d.gr.gr_gid=mc->d.gr.gr_gid;
+		GR(group)->gr_gid=GR(mc)->gr_gid;
 		flag_dirty++;
 	    }
 	}
+
+	policy=member_policy(group->name);
+	if (policy!=MEMBERS_KEEP && reconcile_members(group, mc, policy))
+	    flag_dirty++;
     }
+    matches_free(&m);
 }
 
 
-int write_passwd(const struct _node* passwd, const char* file) {
-    FILE*	output;
-
-    if (opt_verbose>2)
-	printf("Writing passwd-file to %s\n", file);
-
-    if ((output=fopen(file, "wt"))==NULL) {
-	fprintf(stderr, "Failed to open passwd-file %s for writing: %s\n",
-		file, strerror(errno));
-	return 0;
-    }
+/* Move the entries that also appear in the master file in front of all
+ * other entries, keeping the order within both groups and leaving
+ * everything from the first NIS compat entry on alone.  That is any entry
+ * whose name starts with "+" or "-", not just the plain "+": "+name",
+ * "-name" and "+@netgroup" lines take part in the lookups as well, and
+ * moving an entry across one would change what a lookup finds.  nss_files scans the
+ * files from the top, so the system accounts that daemons look up all
+ * the time are then found without passing over thousands of users.
+ */
+void hoist_master_entries(struct _node** head, struct _node* master) {
+    struct _index	hot;
+    struct _node*	first_cold=NULL;
+    struct _node*	walk;
+    struct _node*	next;
+    unsigned long	depth=0;
+    unsigned long	count=0;
+
+    index_build(&hot, master);
+
+    for (walk=*head; walk && walk->name[0]!='+' && walk->name[0]!='-'; walk=next) {
+	next=walk->next;
+	depth++;
+	ops.steps++;
+	if (index_lookup(&hot, walk->name)==NULL) {
+	    if (first_cold==NULL)
+		first_cold=walk;
+	    continue;
+	}
 
-    for (;passwd; passwd=passwd->next) {
-	assert(passwd->t==t_passwd);
-	if (fputpwent(&(passwd->d.pw), output)!=0) {
-	    fprintf(stderr, "Error writing passwd-entry: %s\n", strerror(errno));
-	    return 0;
+	stats.hot_depth_before+=depth;
+	stats.hot_depth_after+=++count;
+	if (first_cold) {
+	    if (opt_verbose>2)
+		printf("Moving \"%s\" to before \"%s\"\n", walk->name, first_cold->name);
+	    remove_node(head, walk);
+	    insert_node(head, walk, first_cold);
+	    stats.hot_moved++;
+	    flag_dirty++;
 	}
     }
+    stats.hot_entries+=count;
 
-    if (fclose(output)!=0) {
-	fprintf(stderr, "Error closing passwd-file: %s\n", strerror(errno));
-	return 0;
+    index_free(&hot);
+}
+
+
+/* Report entries of the extra file sets that share a name with a master
+ * entry, and bring them in line with the master files.  Entries are never
+ * added to or removed from extra sets; the master entries belong in the
+ * system files.  All sets are checked against one index of the master
+ * names.
+ */
+void process_extra_sets() {
+    struct _index	accounts;
+    struct _index	groups;
+    const char*		saved_user_domain=user_domain;
+    const char*		saved_group_domain=group_domain;
+    struct _node*	walk;
+    int			i;
+
+    index_build(&accounts, master_accounts);
+    index_build(&groups, master_groups);
+
+    /* Questions about extra sets must not be confused with those about
+     * the system files.
+     */
+    user_domain="other";
+    group_domain="other";
+
+    for (i=0; i<extra_count; i++) {
+	struct _fileset*	set=&extra_sets[i];
+	int			changes=flag_dirty;
+
+	if (opt_verbose)
+	    for (walk=set->groups; walk; walk=walk->next)
+		if (index_lookup(&groups, walk->name))
+		    printf("Group \"%s\" from the master file is also defined in %s\n", walk->name, set->group);
+	if (opt_verbose)
+	    for (walk=set->accounts; walk; walk=walk->next)
+		if (index_lookup(&accounts, walk->name))
+		    printf("User \"%s\" from the master file is also defined in %s\n", walk->name, set->passwd);
+
+	process_changed_groups(set->groups, master_groups);
+	process_changed_accounts(set->accounts, system_groups, master_accounts);
+	set->dirty=(flag_dirty!=changes);
     }
 
-    return 1;
+    user_domain=saved_user_domain;
+    group_domain=saved_group_domain;
+    index_free(&accounts);
+    index_free(&groups);
 }
 
 
-int write_shadow(const struct _node* shadow, const char* file) {
-    FILE*	output;
+/* Directories searched for sysusers.d fragments, in order of precedence.
+ * A fragment hides any fragment with the same name in a later directory.
+ */
+const char* sysusers_dirs[] = {
+    "/etc/sysusers.d",
+    "/run/sysusers.d",
+    "/usr/lib/sysusers.d",
+    NULL
+};
 
-    if (opt_verbose>2)
-	printf("Writing shadow-file to %s\n", file);
+/* The ids in the dynamic system range that are in use, one flag per id */
+struct _idmap {
+    struct _node*	list;
+    unsigned char	used[SYSUSERS_ID_MAX+1];
+};
 
-    if ((output=fopen(file, "wt"))==NULL) {
-	fprintf(stderr, "Failed to open shadow-file %s for writing: %s\n",
-	       	file, strerror(errno));
-	return 0;
-    }
+/* A sysusers.d fragment found while scanning the directories */
+struct _fragment {
+    char*	name;
+    char*	path;
+    int		prio;
+};
 
-    for (;shadow; shadow=shadow->next) {
-	assert(shadow->t==t_shadow);
-	if (putspent(&(shadow->d.sp), output)!=0) {
-	    fprintf(stderr, "Error writing shadow-entry: %s\n", strerror(errno));
-	    return 0;
-	}
-    }
 
-    if (fclose(output)!=0) {
-	fprintf(stderr, "Error closing shadow-file: %s\n", strerror(errno));
+/* Split the next field off a sysusers.d line.  Fields are separated by
+ * whitespace and may be enclosed in double quotes.  Returns 0 when there
+ * are no more fields.  A field of "-" is returned as NULL.
+ */
+int next_sysusers_field(char** line, char** value) {
+    char*	p=*line;
+    char*	out;
+
+    while (isspace((int)*p))
+	p++;
+    if (*p=='\0' || *p=='#')
 	return 0;
+
+    if (*p=='"') {
+	*value=out=++p;
+	while (*p && *p!='"')
+	    *out++=*p++;
+    } else {
+	*value=out=p;
+	while (*p && !isspace((int)*p))
+	    out++, p++;
     }
+    if (*p)
+	p++;
+    *out='\0';
+    *line=p;
 
+    if (strcmp(*value, "-")==0)
+	*value=NULL;
     return 1;
 }
 
 
-#ifndef HAVE_PUTGRENT
-int putgrent(const struct group* g, FILE* f) {
-    int idx;
-    fprintf(f, "%s:%s:%u:", g->gr_name, g->gr_passwd, g->gr_gid);
-    if (g->gr_mem)
-	for (idx=0; g->gr_mem[idx]; idx++)
-	    fprintf(f, ((idx==0) ? "%s" : ",%s"), g->gr_mem[idx]);
+/* Parse the numeric part of an id field.  Returns (uid_t)-1 if the field
+ * is absent or not a number; we don't support taking ids from the owner
+ * of a path.
+ */
+uid_t parse_sysusers_id(const char* field) {
+    char*		end;
+    unsigned long	id;
+
+    if (field==NULL || !isdigit((int)*field))
+	return (uid_t)-1;
+    id=strtoul(field, &end, 10);
+    if (*end!='\0' && *end!=':')
+	return (uid_t)-1;
+    return (uid_t)id;
+}
+
+
+/* Record which ids of a list fall in the dynamic system range.
+ */
+void idmap_build(struct _idmap* map, struct _node* list) {
+    map->list=list;
+    memset(map->used, 0, sizeof(map->used));
+    for (; list; list=list->next)
+	if (list->id<=SYSUSERS_ID_MAX && list->name[0]!='+')
+	    map->used[list->id]=1;
+}
+
+
+/* Pick an id for a new entry: preferred if that is free, otherwise the
+ * highest free id of the dynamic system range, like systemd-sysusers.
+ */
+uid_t idmap_allocate(struct _idmap* map, uid_t preferred) {
+    uid_t	id;
+
+    if (preferred!=(uid_t)-1) {
+	if (preferred>SYSUSERS_ID_MAX) {
+	    if (find_by_id(map->list, preferred)==NULL)
+		return preferred;
+	} else if (!map->used[preferred]) {
+	    map->used[preferred]=1;
+	    return preferred;
+	}
+    }
+
+    for (id=SYSUSERS_ID_MAX; id>=SYSUSERS_ID_MIN; id--)
+	if (!map->used[id]) {
+	    map->used[id]=1;
+	    return id;
+	}
+
+    fprintf(stderr, "No free system id left for sysusers.d entries\n");
+    exit(1);
+}
+
+
+/* Add a user to the member list of a group.  Returns 0 if it was a member
+ * already.
+ */
+int add_group_member(struct _node* group, const char* user) {
+    char**	members=GR(group)->gr_mem;
+    int		count;
+
+    for (count=0; members[count]; count++)
+	if (strcmp(members[count], user)==0)
+	    return 0;
+
+    members=realloc(members, (count+2)*sizeof(char*));
+    if (members==NULL) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    members[count]=xstrdup(user);
+    members[count+1]=NULL;
+    GR(group)->gr_mem=members;
+
+    return 1;
+}
+
+
+/* Create a group requested by a sysusers.d fragment, unless a group with
+ * that name exists.  Returns the group.
+ */
+struct _node* apply_sysusers_group(struct _index* groups, struct _idmap* gids, const char* name, uid_t gid, const char* source) {
+    struct _node*	node;
+    struct group	gr;
+    char*		nomembers[]={ NULL };
+
+    if ((node=index_lookup(groups, name))!=NULL)
+	return node;
+
+    gr.gr_name=(char*)name;
+    gr.gr_passwd="*";
+    gr.gr_gid=idmap_allocate(gids, gid);
+    gr.gr_mem=nomembers;
+
+    if (opt_verbose && !log_stream)
+	printf("Adding group \"%s\" (%u) from %s\n", name, gr.gr_gid, source);
+    node=new_group_node(&gr);
+    node->id=gr.gr_gid;
+    log_decision("group-add", node, NULL, source, 1);
+    add_node(&system_groups, node, 1);
+    index_add(groups, node);
+    flag_dirty++;
+
+    return node;
+}
+
+
+/* Create a user requested by a sysusers.d fragment, along with a group of
+ * the same name unless the id field names another group.
+ */
+void apply_sysusers_user(struct _index* users, struct _index* groups, struct _idmap* uids, struct _idmap* gids, const char* name, char* id, const char* gecos, const char* home, const char* shell, const char* source) {
+    struct _node*	node;
+    struct _node*	group;
+    struct passwd	pw;
+    uid_t		uid=parse_sysusers_id(id);
+    char*		sep=id ? strchr(id, ':') : NULL;
+
+    if (index_lookup(users, name)!=NULL)
+	return;
+
+    if (sep) {
+	group=index_lookup(groups, sep+1);
+	if (group==NULL)
+	    group=find_by_id(system_groups, parse_sysusers_id(sep+1));
+	if (group==NULL) {
+	    fprintf(stderr, "Group \"%s\" for user \"%s\" in %s does not exist\n", sep+1, name, source);
+	    return;
+	}
+    } else
+	group=apply_sysusers_group(groups, gids, name, uid, source);
+
+    pw.pw_name=(char*)name;
+    pw.pw_passwd="*";
+    pw.pw_uid=idmap_allocate(uids, (uid!=(uid_t)-1) ? uid : GR(group)->gr_gid);
+    pw.pw_gid=GR(group)->gr_gid;
+    pw.pw_gecos=(char*)(gecos ? gecos : "");
+    pw.pw_dir=(char*)(home ? home : "/");
+    pw.pw_shell=(char*)(shell ? shell : SYSUSERS_SHELL);
+
+    if (opt_verbose && !log_stream)
+	printf("Adding user \"%s\" (%u) from %s\n", name, pw.pw_uid, source);
+    node=new_passwd_node(&pw);
+    node->id=pw.pw_uid;
+    log_decision("user-add", node, NULL, source, 1);
+    add_node(&system_accounts, node, 1);
+    nodelist_append(&accounts_added, node);
+    index_add(users, node);
+    flag_dirty++;
+}
+
+
+/* Apply one sysusers.d fragment.  Like systemd-sysusers we only create
+ * users and groups and add group members; existing entries are never
+ * modified.
+ */
+int apply_sysusers_file(const char* file, struct _index* users, struct _index* groups, struct _idmap* uids, struct _idmap* gids) {
+    FILE*	input;
+    char*	line=NULL;
+    size_t	size=0;
+
+    if (opt_verbose>2)
+	printf("Reading sysusers.d fragment %s\n", file);
+
+    if ((input=fopen(file, "r"))==NULL) {
+	fprintf(stderr, "Error opening sysusers.d fragment %s: %s\n", file, strerror(errno));
+	return 1;
+    }
+
+    while (getline(&line, &size, input)!=-1) {
+	char*	p=line;
+	char*	type=NULL;
+	char*	name=NULL;
+	char*	id=NULL;
+	char*	gecos=NULL;
+	char*	home=NULL;
+	char*	shell=NULL;
+
+	if (!next_sysusers_field(&p, &type) || !next_sysusers_field(&p, &name))
+	    continue;
+	if (type==NULL || name==NULL)
+	    continue;
+	if (next_sysusers_field(&p, &id) && next_sysusers_field(&p, &gecos) &&
+		next_sysusers_field(&p, &home))
+	    next_sysusers_field(&p, &shell);
+
+	if (strcmp(type, "u")==0)
+	    apply_sysusers_user(users, groups, uids, gids, name, id, gecos, home, shell, file);
+	else if (strcmp(type, "g")==0)
+	    apply_sysusers_group(groups, gids, name, parse_sysusers_id(id), file);
+	else if (strcmp(type, "m")==0 && id!=NULL) {
+	    struct _node*	group=apply_sysusers_group(groups, gids, id, (uid_t)-1, file);
+
+	    if (index_lookup(users, name) && add_group_member(group, name)) {
+		log_member(group, name, 1);
+		if (opt_verbose && !log_stream)
+		    printf("Adding user \"%s\" to group \"%s\" from %s\n", name, id, file);
+		flag_dirty++;
+	    }
+	}
+    }
+
+    free(line);
+    fclose(input);
+    return 0;
+}
+
+
+int compare_fragments(const void* a, const void* b) {
+    const struct _fragment*	fa=a;
+    const struct _fragment*	fb=b;
+    int				ret=strcmp(fa->name, fb->name);
+
+    return ret ? ret : fa->prio-fb->prio;
+}
+
+
+/* Apply the sysusers.d fragments found in the given directories.  Files are
+ * applied in lexical order of their names, and of several files with the
+ * same name only the one in the earliest directory is used.  Returns
+ * non-zero if a fragment could not be read.
+ */
+int process_sysusers(const char** dirs) {
+    struct _fragment*	fragments=NULL;
+    struct _index	users;
+    struct _index	groups;
+    struct _idmap*	uids;
+    struct _idmap*	gids;
+    size_t		count=0;
+    size_t		i;
+    int			d;
+    int			ret=0;
+
+    for (d=0; dirs[d]; d++) {
+	DIR*		dir;
+	struct dirent*	ent;
+
+	if ((dir=opendir(dirs[d]))==NULL)
+	    continue;
+	while ((ent=readdir(dir))!=NULL) {
+	    size_t	len=strlen(ent->d_name);
+
+	    if (len<6 || strcmp(ent->d_name+len-5, ".conf")!=0)
+		continue;
+	    fragments=realloc(fragments, (count+1)*sizeof(struct _fragment));
+	    if (fragments==NULL) {
+		fprintf(stderr, "Out of memory!\n");
+		exit(1);
+	    }
+	    fragments[count].name=xstrdup(ent->d_name);
+	    fragments[count].path=xasprintf("%s/%s", dirs[d], ent->d_name);
+	    fragments[count].prio=d;
+	    count++;
+	}
+	closedir(dir);
+    }
+    qsort(fragments, count, sizeof(struct _fragment), compare_fragments);
+
+    index_build(&users, system_accounts);
+    index_build(&groups, system_groups);
+    uids=xmalloc(sizeof(struct _idmap));
+    gids=xmalloc(sizeof(struct _idmap));
+    idmap_build(uids, system_accounts);
+    idmap_build(gids, system_groups);
+
+    for (i=0; i<count; i++) {
+	if (i==0 || strcmp(fragments[i].name, fragments[i-1].name)!=0)
+	    if (apply_sysusers_file(fragments[i].path, &users, &groups, uids, gids)!=0)
+		ret=1;
+	free(fragments[i].name);
+	free(fragments[i].path);
+    }
+
+    free(fragments);
+    free(uids);
+    free(gids);
+    index_free(&users);
+    index_free(&groups);
+
+    return ret;
+}
+
+
+/* The state of a database file when we read it.  We only lock the files
+ * after all questions have been answered, so another program may have
+ * written them in the meantime; replacing them with our copy would then
+ * silently undo its change.
+ */
+struct _snapshot {
+    const char*	file;
+    int		exists;
+    struct stat	st;
+};
+
+#define MAX_SNAPSHOTS	(5+2*MAX_EXTRA_SETS)
+
+struct _snapshot	snapshots[MAX_SNAPSHOTS];
+int			snapshot_count	= 0;
+
+/* Remember the state of a file we are about to read and may write back.
+ */
+void remember_file(const char* file) {
+    struct _snapshot*	snap=&snapshots[snapshot_count++];
+
+    snap->file=file;
+    snap->exists=(stat(file, &snap->st)==0);
+}
+
+
+/* Check that none of the files we read has been changed since.  Writers
+ * replace the databases by renaming a new file over them or rewrite them
+ * in place, which changes the inode or the modification times.
+ */
+int files_unchanged() {
+    struct stat	st;
+    int		i;
+
+    for (i=0; i<snapshot_count; i++) {
+	const struct _snapshot*	snap=&snapshots[i];
+	int			exists=(stat(snap->file, &st)==0);
+
+	if (exists!=snap->exists || (exists &&
+		    (st.st_dev!=snap->st.st_dev || st.st_ino!=snap->st.st_ino ||
+		     st.st_size!=snap->st.st_size ||
+		     st.st_mtim.tv_sec!=snap->st.st_mtim.tv_sec ||
+		     st.st_mtim.tv_nsec!=snap->st.st_mtim.tv_nsec ||
+		     st.st_ctim.tv_sec!=snap->st.st_ctim.tv_sec ||
+		     st.st_ctim.tv_nsec!=snap->st.st_ctim.tv_nsec))) {
+	    fprintf(stderr, "%s was changed by another program while we were working, not overwriting it\n", snap->file);
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+
+/* Bring the shadow database in line with the accounts added to and
+ * removed from passwd.  The shadow file is only read if there are such
+ * changes, and is only rewritten if it had to change.  A missing shadow
+ * file is not an error; then shadow passwords are simply not in use.
+ */
+int sync_shadow() {
+    struct _index	index;
+    size_t		i;
+
+    if (accounts_added.count==0 && accounts_removed.count==0) {
+	if (opt_verbose>2)
+	    printf("No accounts added or removed, not reading shadow\n");
+	return 0;
+    }
+
+    remember_file(sys_shadow);
+    if (read_shadow(&system_shadow, sys_shadow)!=0)
+	return (errno==ENOENT) ? 0 : 2;
+
+    index_build(&index, system_shadow);
+
+    for (i=0; i<accounts_removed.count; i++) {
+	struct _node*	node=index_lookup(&index, accounts_removed.nodes[i]->name);
+
+	if (node==NULL)
+	    continue;
+	if (opt_verbose>2)
+	    printf("Removing shadow entry for \"%s\"\n", node->name);
+	remove_node(&system_shadow, node);
+	index_remove(&index, node);
+	flag_shadow++;
+    }
+
+    for (i=0; i<accounts_added.count; i++) {
+	struct _node*	node;
+	struct spwd	sp;
+
+	if (index_lookup(&index, accounts_added.nodes[i]->name))
+	    continue;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sp_namp=(char*)accounts_added.nodes[i]->name;
+	sp.sp_pwdp="*";
+	sp.sp_lstchg=time(NULL)/(60*60*24);
+	sp.sp_min=0;
+	sp.sp_max=99999;
+	sp.sp_warn=7;
+	sp.sp_inact=-1;
+	sp.sp_expire=-1;
+	sp.sp_flag=~0UL;
+
+	if (opt_verbose>2)
+	    printf("Adding shadow entry for \"%s\"\n", sp.sp_namp);
+	node=new_spwd_node(&sp);
+	add_node(&system_shadow, node, 0);
+	index_add(&index, node);
+	flag_shadow++;
+    }
+
+    index_free(&index);
+    return 0;
+}
+
+
+/* The ranges handed out to new users, the defaults of useradd(8) from
+ * login.defs(5).  By default only regular users get them, as system
+ * accounts don't run user namespaces; --subid-users changes that.
+ */
+#define SUBID_MIN	100000UL
+#define SUBID_MAX	600100000UL
+#define SUBID_COUNT	65536UL
+#define SUBID_USER_MIN	1000
+#define SUBID_USER_MAX	60000
+
+uid_t		subid_user_min	= SUBID_USER_MIN;
+uid_t		subid_user_max	= SUBID_USER_MAX;
+
+struct _node* new_subid_node(const char* name, unsigned long start, unsigned long count) {
+    struct _subnode*	sub;
+
+    sub=xmalloc(sizeof(struct _subnode));
+    memset(sub, 0, sizeof(struct _subnode));
+    sub->n.name=xstrdup(name);
+    sub->start=start;
+    sub->count=count;
+
+    return &sub->n;
+}
+
+
+/* Parse a number of a subordinate id range.  Returns 0 if it is not one.
+ */
+int parse_subid_number(const char* field, unsigned long* value) {
+    char*	end;
+
+    if (!isdigit((unsigned char)*field))
+	return 0;
+    errno=0;
+    *value=strtoul(field, &end, 10);
+    return (*end=='\0' && errno==0);
+}
+
+
+/* Read a subuid or subgid file, which lists one NAME:START:COUNT range per
+ * line.  A missing file has no ranges yet.
+ */
+int read_subids(struct _subids* db) {
+    FILE*	input;
+    char*	line=NULL;
+    size_t	size=0;
+    ssize_t	len;
+    unsigned	lineno=0;
+    int		ret=0;
+
+    if (opt_verbose>2)
+	printf("Reading %s from %s\n", db->descr, db->file);
+
+    if ((input=fopen(db->file, "r"))==NULL) {
+	if (errno==ENOENT)
+	    return 0;
+	fprintf(stderr, "Error opening %s file %s: %s\n", db->descr, db->file, strerror(errno));
+	return 2;
+    }
+
+    while ((len=getline(&line, &size, input))!=-1) {
+	char*		start;
+	char*		count;
+	unsigned long	first;
+	unsigned long	number;
+
+	lineno++;
+	if (len>0 && line[len-1]=='\n')
+	    line[--len]='\0';
+	if (len==0)
+	    continue;
+
+	if ((start=strchr(line, ':'))==NULL || (count=strchr(start+1, ':'))==NULL) {
+	    fprintf(stderr, "%s:%u: invalid %s entry\n", db->file, lineno, db->descr);
+	    ret=2;
+	    break;
+	}
+	*start++='\0';
+	*count++='\0';
+	if (!*line || !parse_subid_number(start, &first) ||
+		!parse_subid_number(count, &number) || number>ULONG_MAX-first) {
+	    fprintf(stderr, "%s:%u: invalid %s entry\n", db->file, lineno, db->descr);
+	    ret=2;
+	    break;
+	}
+
+	add_node(&db->ranges, new_subid_node(line, first, number), 0);
+	ops.parsed++;
+    }
+
+    if (ret==0 && ferror(input)) {
+	fprintf(stderr, "Error reading %s file %s: %s\n", db->descr, db->file, strerror(errno));
+	ret=2;
+    }
+
+    free(line);
+    fclose(input);
+
+    return ret;
+}
+
+
+int write_subids(const struct _node* range, const char* file) {
+    FILE*	output;
+
+    if (opt_verbose>2)
+	printf("Writing subordinate ids to %s\n", file);
+
+    if ((output=fopen(file, "wt"))==NULL) {
+	fprintf(stderr, "Failed to open %s for writing: %s\n",
+		file, strerror(errno));
+	return 0;
+    }
+
+    for (;range; range=range->next) {
+	if (fprintf(output, "%s:%lu:%lu\n", range->name, SUB(range)->start, SUB(range)->count)<0) {
+	    fprintf(stderr, "Error writing subordinate id range: %s\n", strerror(errno));
+	    return 0;
+	}
+    }
+
+    if (fclose(output)!=0) {
+	fprintf(stderr, "Error closing %s: %s\n", file, strerror(errno));
+	return 0;
+    }
+
+    return 1;
+}
+
+
+int compare_ranges(const void* a, const void* b) {
+    const struct _subnode*	ra=*(const struct _subnode* const*)a;
+    const struct _subnode*	rb=*(const struct _subnode* const*)b;
+
+    if (ra->start!=rb->start)
+	return (ra->start<rb->start) ? -1 : 1;
+    if (ra->count!=rb->count)
+	return (ra->count<rb->count) ? -1 : 1;
+    return 0;
+}
+
+
+int compare_uids(const void* a, const void* b) {
+    uid_t	ua=*(const uid_t*)a;
+    uid_t	ub=*(const uid_t*)b;
+
+    return (ua>ub)-(ua<ub);
+}
+
+
+/* Check whether a range still has an owner.  Owners are user names, or
+ * uids for ranges that were given out by number.
+ */
+int range_has_owner(const struct _node* range, const struct _index* users, const uid_t* uids, size_t nuids) {
+    unsigned long	uid;
+    uid_t		id;
+
+    if (index_lookup(users, range->name))
+	return 1;
+    if (!parse_subid_number(range->name, &uid))
+	return 0;
+    id=uid;
+    return bsearch(&id, uids, nuids, sizeof(uid_t), compare_uids)!=NULL;
+}
+
+
+/* Bring one subordinate id file in line with the accounts.  The ranges of
+ * accounts removed in this run are dropped and those of accounts that are
+ * gone otherwise are reported.  The remaining ranges are sorted by their
+ * start once, which shows every range overlapping an earlier one in a
+ * single sweep, and new users get the first free ranges above the ones
+ * in use, found by the same sweep.  Unknown owners and overlaps are
+ * added to problems.
+ */
+int sync_subid_file(struct _subids* db, const struct _index* users, const uid_t* uids, size_t nuids, int* problems) {
+    struct _index	removed;
+    struct _index	owners;
+    struct _node**	sorted;
+    struct _node*	walk;
+    struct _node*	next;
+    const struct _node*	widest=NULL;
+    unsigned long	cursor=SUBID_MIN;
+    size_t		count=0;
+    size_t		i;
+    size_t		j;
+
+    remember_file(db->file);
+    if (read_subids(db)!=0)
+	return 2;
+
+    index_init(&removed, accounts_removed.count);
+    for (i=0; i<accounts_removed.count; i++)
+	index_add(&removed, accounts_removed.nodes[i]);
+
+    for (walk=db->ranges; walk; walk=next) {
+	next=walk->next;
+	if (range_has_owner(walk, users, uids, nuids)) {
+	    count++;
+	    continue;
+	}
+	if (opt_sanity || !index_lookup(&removed, walk->name)) {
+	    fprintf(stderr, "%s range %lu-%lu belongs to unknown user \"%s\"\n", db->descr,
+		    SUB(walk)->start, SUB(walk)->start+SUB(walk)->count-1, walk->name);
+	    (*problems)++;
+	    count++;
+	    continue;
+	}
+	if (opt_verbose && !log_stream)
+	    printf("Removing %s range %lu-%lu of \"%s\"\n", db->descr,
+		    SUB(walk)->start, SUB(walk)->start+SUB(walk)->count-1, walk->name);
+	remove_node(&db->ranges, walk);
+	db->dirty=1;
+	flag_dirty++;
+    }
+    index_free(&removed);
+
+    sorted=xmalloc((count+1)*sizeof(struct _node*));
+    for (count=0, walk=db->ranges; walk; walk=walk->next)
+	if (SUB(walk)->count)
+	    sorted[count++]=walk;
+    qsort(sorted, count, sizeof(struct _node*), compare_ranges);
+
+    for (i=0; i<count; i++) {
+	const struct _subnode*	range=SUB(sorted[i]);
+
+	if (widest && range->start<SUB(widest)->start+SUB(widest)->count) {
+	    fprintf(stderr, "%s range %lu-%lu of \"%s\" overlaps range %lu-%lu of \"%s\"\n", db->descr,
+		    range->start, range->start+range->count-1, range->n.name,
+		    SUB(widest)->start, SUB(widest)->start+SUB(widest)->count-1, widest->name);
+	    (*problems)++;
+	}
+	if (!widest || range->start+range->count>SUB(widest)->start+SUB(widest)->count)
+	    widest=sorted[i];
+    }
+
+    if (opt_sanity) {
+	free(sorted);
+	return 0;
+    }
+
+    /* New ranges are handed out in increasing order, so the sweep for free
+     * space never has to go back.
+     */
+    index_build(&owners, db->ranges);
+    for (i=0, j=0; i<accounts_added.count; i++) {
+	struct _node*	account=accounts_added.nodes[i];
+	struct _node*	range;
+
+	if (PW(account)->pw_uid<subid_user_min || PW(account)->pw_uid>subid_user_max)
+	    continue;
+	if (index_lookup(&owners, account->name))
+	    continue;
+
+	while (j<count) {
+	    const struct _subnode*	used=SUB(sorted[j]);
+
+	    if (used->start+used->count<=cursor)
+		j++;
+	    else if (used->start<cursor+SUBID_COUNT) {
+		cursor=used->start+used->count;
+		j++;
+	    } else
+		break;
+	}
+	if (cursor+SUBID_COUNT-1>SUBID_MAX) {
+	    fprintf(stderr, "No free %s range left for \"%s\"\n", db->descr, account->name);
+	    index_free(&owners);
+	    free(sorted);
+	    return 2;
+	}
+
+	if (opt_verbose && !log_stream)
+	    printf("Adding %s range %lu-%lu for \"%s\"\n", db->descr,
+		    cursor, cursor+SUBID_COUNT-1, account->name);
+	range=new_subid_node(account->name, cursor, SUBID_COUNT);
+	add_node(&db->ranges, range, 0);
+	index_add(&owners, range);
+	cursor+=SUBID_COUNT;
+	db->dirty=1;
+	flag_dirty++;
+    }
+
+    index_free(&owners);
+    free(sorted);
+    return 0;
+}
+
+
+/* Keep the subuid and subgid files in line with the accounts.  Both list
+ * their ranges by user, so both are checked against the passwd file.
+ * Problems found in either are added to problems.
+ */
+int sync_subids(int* problems) {
+    struct _index	users;
+    struct _node*	walk;
+    uid_t*		uids;
+    size_t		nuids=0;
+    int			ret=0;
+    int			i;
+
+    index_build(&users, system_accounts);
+    for (walk=system_accounts; walk; walk=walk->next)
+	nuids++;
+    uids=xmalloc((nuids+1)*sizeof(uid_t));
+    for (nuids=0, walk=system_accounts; walk; walk=walk->next)
+	uids[nuids++]=PW(walk)->pw_uid;
+    qsort(uids, nuids, sizeof(uid_t), compare_uids);
+
+    for (i=0; i<2 && ret==0; i++)
+	ret=sync_subid_file(&subids[i], &users, uids, nuids, problems);
+
+    free(uids);
+    index_free(&users);
+    return ret;
+}
+
+
+/* Join the members of a group into a comma separated list, the way they
+ * appear in the group file.  Returns newly allocated memory.
+ */
+char* join_members(char** members) {
+    size_t	len=1;
+    char*	result;
+    int		i;
+
+    for (i=0; members && members[i]; i++)
+	len+=strlen(members[i])+1;
+    result=xmalloc(len);
+    result[0]='\0';
+    for (i=0; members && members[i]; i++) {
+	if (i)
+	    strcat(result, ",");
+	strcat(result, members[i]);
+    }
+
+    return result;
+}
+
+
+/* Report one edit found by diff_entries.  Operations without a field
+ * leave field, old and new NULL.
+ */
+void print_edit(const char* op, const char* descr, const struct _node* node, const char* field, const char* old, const char* new) {
+    if (opt_json) {
+	printf("{\"op\":\"%s\",\"type\":\"%s\",\"name\":", op, descr);
+	fputjson(node->name, stdout);
+	printf(",\"id\":%u", node->id);
+	if (field) {
+	    printf(",\"field\":\"%s\",\"old\":", field);
+	    fputjson(old, stdout);
+	    printf(",\"new\":");
+	    fputjson(new, stdout);
+	}
+	printf("}\n");
+    } else if (field)
+	printf("%s %s \"%s\": %s \"%s\" -> \"%s\"\n", op, descr, node->name, field, safestr(old), safestr(new));
+    else
+	printf("%s %s \"%s\" (%u)\n", op, descr, node->name, node->id);
+}
+
+
+/* Compare a field of an entry present in both versions of a database.
+ * Returns the number of edits reported (0 or 1).
+ */
+int diff_field(const char* descr, const struct _node* node, const char* field, const char* old, const char* new) {
+    if (strcmp(safestr(old), safestr(new))==0)
+	return 0;
+    print_edit("change", descr, node, field, old, new);
+    return 1;
+}
+
+
+/* Compare a numeric field of an entry present in both versions.
+ */
+int diff_id(const char* descr, const struct _node* node, const char* field, unsigned old, unsigned new) {
+    char	oldstr[16];
+    char	newstr[16];
+
+    if (old==new)
+	return 0;
+    snprintf(oldstr, sizeof(oldstr), "%u", old);
+    snprintf(newstr, sizeof(newstr), "%u", new);
+    print_edit("change", descr, node, field, oldstr, newstr);
+    return 1;
+}
+
+
+/* Build an index of the entries that come after the first NIS compat
+ * ("+") entry of a list.
+ */
+void index_after_plus(struct _index* index, struct _node* head) {
+    while (head && strcmp(head->name, "+")!=0)
+	head=head->next;
+    index_build(index, head ? head->next : NULL);
+}
+
+
+/* Produce a field-level edit script that turns one version of a passwd or
+ * group database into another.  Entries are matched by name through hash
+ * indexes, so reordering doesn't show up as changes and the whole diff
+ * takes linear time.  Returns the number of edits.
+ */
+int diff_entries(struct _node* old, struct _node* new, const char* descr) {
+    struct _index	old_index;
+    struct _index	new_index;
+    struct _index	old_after;
+    struct _node*	walk;
+    int			after_plus=0;
+    int			edits=0;
+
+    index_build(&old_index, old);
+    index_build(&new_index, new);
+    index_after_plus(&old_after, old);
+
+    for (walk=old; walk; walk=walk->next)
+	if (index_lookup(&old_index, walk->name)==walk &&
+		index_lookup(&new_index, walk->name)==NULL) {
+	    print_edit("remove", descr, walk, NULL, NULL, NULL);
+	    edits++;
+	}
+
+    for (walk=new; walk; walk=walk->next) {
+	struct _node*	oc;	/* old copy of this entry */
+
+	if (index_lookup(&new_index, walk->name)!=walk)
+	    continue;
+
+	oc=index_lookup(&old_index, walk->name);
+	if (oc==NULL) {
+	    print_edit("add", descr, walk, NULL, NULL, NULL);
+	    edits++;
+	} else {
+	    if ((index_lookup(&old_after, walk->name)!=NULL)!=after_plus) {
+		print_edit(after_plus ? "move-after-plus" : "move-before-plus", descr, walk, NULL, NULL, NULL);
+		edits++;
+	    }
+
+	    if (strcmp(descr, "group")==0) {
+		char*	oldmem=join_members(GR(oc)->gr_mem);
+		char*	newmem=join_members(GR(walk)->gr_mem);
+
+		edits+=diff_id(descr, walk, "gid", GR(oc)->gr_gid, GR(walk)->gr_gid);
+		edits+=diff_field(descr, walk, "members", oldmem, newmem);
+		free(oldmem);
+		free(newmem);
+	    } else {
+		edits+=diff_id(descr, walk, "uid", PW(oc)->pw_uid, PW(walk)->pw_uid);
+		edits+=diff_id(descr, walk, "gid", PW(oc)->pw_gid, PW(walk)->pw_gid);
+		edits+=diff_field(descr, walk, "gecos", PW(oc)->pw_gecos, PW(walk)->pw_gecos);
+		edits+=diff_field(descr, walk, "home", PW(oc)->pw_dir, PW(walk)->pw_dir);
+		edits+=diff_field(descr, walk, "shell", PW(oc)->pw_shell, PW(walk)->pw_shell);
+	    }
+	}
+
+	if (strcmp(walk->name, "+")==0)
+	    after_plus=1;
+    }
+
+    index_free(&old_index);
+    index_free(&new_index);
+    index_free(&old_after);
+
+    return edits;
+}
+
+
+/* State for applying a --bulk spec file */
+struct _bulk {
+    const char*		file;
+    unsigned		line;
+    struct _index	users;
+    struct _index	groups;
+    struct _index	gids;		/* groups by gid, see bulk_gid */
+    struct _index	added;		/* users added by the spec */
+    struct _index	removed;	/* users whose memberships must go */
+    struct _nodelist	gid_nodes;	/* everything to free */
+    struct _nodelist	dropped;	/* removed groups, by gid */
+};
+
+/* A group found by its gid, which is the name of the node.  Also records
+ * the line that removed a group, for the check in check_bulk_gids.
+ */
+struct _bulk_gid {
+    struct _node	n;
+    struct _node*	group;
+    unsigned		line;
+};
+
+
+/* Parse an id in a bulk spec.  Returns (uid_t)-1 if it is not a number.
+ */
+uid_t parse_bulk_id(const char* field) {
+    if (field==NULL || strchr(field, ':')!=NULL)
+	return (uid_t)-1;
+    return parse_sysusers_id(field);
+}
+
+
+/* Make a record for a group by its gid.
+ */
+struct _bulk_gid* bulk_gid(struct _bulk* bulk, struct _node* group) {
+    struct _bulk_gid*	ref=xmalloc(sizeof(struct _bulk_gid));
+
+    memset(ref, 0, sizeof(struct _bulk_gid));
+    ref->n.name=xasprintf("%u", GR(group)->gr_gid);
+    ref->group=group;
+    ref->line=0;
+    nodelist_append(&bulk->gid_nodes, &ref->n);
+
+    return ref;
+}
+
+
+/* Add a group to the index by gid.  Of several groups with the same gid
+ * the first one stays, as with find_by_id.
+ */
+void bulk_index_gid(struct _bulk* bulk, struct _node* group) {
+    char	gid[16];
+
+    snprintf(gid, sizeof(gid), "%u", GR(group)->gr_gid);
+    if (index_lookup(&bulk->gids, gid)==NULL)
+	index_add(&bulk->gids, &bulk_gid(bulk, group)->n);
+}
+
+
+/* Take a group out of the index by gid.
+ */
+void bulk_unindex_gid(struct _bulk* bulk, const struct _node* group) {
+    struct _node*	ref;
+    char		gid[16];
+
+    snprintf(gid, sizeof(gid), "%u", GR(group)->gr_gid);
+    if ((ref=index_lookup(&bulk->gids, gid))!=NULL && ((struct _bulk_gid*)ref)->group==group)
+	index_remove(&bulk->gids, ref);
+}
+
+
+/* Resolve a group given by name or by gid.  Returns (gid_t)-1 and reports
+ * an error if there is no such group.  Another group with the gid of one
+ * that was removed or renumbered isn't in the index by gid, so only then
+ * the list is searched.
+ */
+gid_t bulk_group(struct _bulk* bulk, const char* field) {
+    struct _node*	group;
+    gid_t		gid;
+
+    if (field!=NULL && (group=index_lookup(&bulk->groups, field))!=NULL)
+	return GR(group)->gr_gid;
+
+    gid=parse_bulk_id(field);
+    if (gid==(gid_t)-1 || (index_lookup(&bulk->gids, field)==NULL &&
+		find_by_id(system_groups, gid)==NULL)) {
+	fprintf(stderr, "%s:%u: group \"%s\" does not exist\n", bulk->file, bulk->line, safestr(field));
+	return (gid_t)-1;
+    }
+    return gid;
+}
+
+
+/* Split a comma separated list of group members.  Returns newly allocated
+ * memory; the names point into the list, which is modified.
+ */
+char** split_members(char* list) {
+    char**	members;
+    char*	p;
+    int		count=0;
+
+    for (p=list; p && *p; p++)
+	if (*p==',')
+	    count++;
+    members=xmalloc((count+2)*sizeof(char*));
+
+    count=0;
+    if (list && *list)
+	for (p=strtok(list, ","); p; p=strtok(NULL, ","))
+	    members[count++]=p;
+    members[count]=NULL;
+
+    return members;
+}
+
+
+/* Create a user from a bulk spec.  Users get a shadow entry like new
+ * users from the master file, and so use "x" as their password.
+ */
+int bulk_user_add(struct _bulk* bulk, char** fields) {
+    struct _node*	node;
+    struct _node*	removed;
+    struct passwd	pw;
+
+    if (index_lookup(&bulk->users, fields[0])) {
+	fprintf(stderr, "%s:%u: user \"%s\" already exists\n", bulk->file, bulk->line, fields[0]);
+	return 1;
+    }
+
+    pw.pw_name=fields[0];
+    pw.pw_passwd="x";
+    pw.pw_uid=parse_bulk_id(fields[1]);
+    if (pw.pw_uid==(uid_t)-1) {
+	fprintf(stderr, "%s:%u: invalid uid \"%s\"\n", bulk->file, bulk->line, safestr(fields[1]));
+	return 1;
+    }
+    if ((pw.pw_gid=bulk_group(bulk, fields[2]))==(gid_t)-1)
+	return 1;
+    pw.pw_gecos=(char*)safestr(fields[3]);
+    pw.pw_dir=(char*)(fields[4] ? fields[4] : "/");
+    pw.pw_shell=(char*)(fields[5] ? fields[5] : SYSUSERS_SHELL);
+
+    node=new_passwd_node(&pw);
+    node->id=pw.pw_uid;
+    log_decision("user-add", node, NULL, NULL, 1);
+    if (opt_verbose && !log_stream)
+	printf("Adding user \"%s\" (%u)\n", node->name, node->id);
+    insert_node(&system_accounts, node, index_lookup(&bulk->users, "+"));
+    index_add(&bulk->users, node);
+    index_add(&bulk->added, node);
+    nodelist_append(&accounts_added, node);
+    flag_dirty++;
+
+    /* A user removed earlier in the spec keeps the memberships given to
+     * the new one.
+     */
+    if ((removed=index_lookup(&bulk->removed, node->name))!=NULL)
+	index_remove(&bulk->removed, removed);
+
+    return 0;
+}
+
+
+/* Remove a user given in a bulk spec.  Its group memberships are dropped
+ * in one pass over the groups once the whole spec has been applied, as
+ * are users added by the spec from the list of new accounts.
+ */
+int bulk_user_remove(struct _bulk* bulk, char** fields) {
+    struct _node*	node=index_lookup(&bulk->users, fields[0]);
+
+    if (node==NULL) {
+	fprintf(stderr, "%s:%u: user \"%s\" does not exist\n", bulk->file, bulk->line, fields[0]);
+	return 1;
+    }
+
+    log_decision("user-remove", node, NULL, NULL, 1);
+    if (opt_verbose && !log_stream)
+	printf("Removing user \"%s\" (%u)\n", node->name, node->id);
+    remove_node(&system_accounts, node);
+    index_remove(&bulk->users, node);
+    index_add(&bulk->removed, node);
+    flag_dirty++;
+
+    /* A user added earlier in the same spec never reaches shadow.
+     */
+    if (index_lookup(&bulk->added, node->name)==node)
+	index_remove(&bulk->added, node);
+    else
+	nodelist_append(&accounts_removed, node);
+
+    return 0;
+}
+
+
+/* Change a field of a user given in a bulk spec.
+ */
+int bulk_user_change(struct _bulk* bulk, char** fields) {
+    struct _node*	node=index_lookup(&bulk->users, fields[0]);
+    struct passwd*	pw;
+    const char*	field=fields[1];
+    char**		value;
+
+    if (node==NULL) {
+	fprintf(stderr, "%s:%u: user \"%s\" does not exist\n", bulk->file, bulk->line, fields[0]);
+	return 1;
+    }
+    pw=PW(node);
+
+    if (field==NULL) {
+	fprintf(stderr, "%s:%u: no field to change\n", bulk->file, bulk->line);
+	return 1;
+    } else if (strcmp(field, "uid")==0) {
+	uid_t	uid=parse_bulk_id(fields[2]);
+
+	if (uid==(uid_t)-1) {
+	    fprintf(stderr, "%s:%u: invalid uid \"%s\"\n", bulk->file, bulk->line, safestr(fields[2]));
+	    return 1;
+	}
+	log_id_decision("user-change-uid", node, pw->pw_uid, uid, 1);
+	if (opt_verbose && !log_stream)
+	    printf("Changing uid of %s from %u to %u\n", node->name, pw->pw_uid, uid);
+	note_renumbered(&renumbered_users, node, pw->pw_uid);
+	node->id=pw->pw_uid=uid;
+	flag_dirty++;
+	return 0;
+    } else if (strcmp(field, "gid")==0) {
+	gid_t	gid=bulk_group(bulk, fields[2]);
+
+	if (gid==(gid_t)-1)
+	    return 1;
+	log_id_decision("user-change-gid", node, pw->pw_gid, gid, 1);
+	if (opt_verbose && !log_stream)
+	    printf("Changing gid of %s from %u to %u\n", node->name, pw->pw_gid, gid);
+	pw->pw_gid=gid;
+	flag_dirty++;
+	return 0;
+    } else if (strcmp(field, "gecos")==0)
+	value=&pw->pw_gecos;
+    else if (strcmp(field, "home")==0)
+	value=&pw->pw_dir;
+    else if (strcmp(field, "shell")==0)
+	value=&pw->pw_shell;
+    else {
+	fprintf(stderr, "%s:%u: unknown user field \"%s\"\n", bulk->file, bulk->line, field);
+	return 1;
+    }
+
+    log_decision(strcmp(field, "gecos")==0 ? "user-change-gecos" :
+	    strcmp(field, "home")==0 ? "user-change-home" : "user-change-shell",
+	    node, *value, safestr(fields[2]), 1);
+    if (opt_verbose && !log_stream)
+	printf("Changing %s of %s from \"%s\" to \"%s\"\n", field, node->name, safestr(*value), safestr(fields[2]));
+    *value=xstrdup(safestr(fields[2]));
+    flag_dirty++;
+
+    return 0;
+}
+
+
+/* Create a group from a bulk spec.
+ */
+int bulk_group_add(struct _bulk* bulk, char** fields) {
+    struct _node*	node;
+    struct group	gr;
+    char**		members;
+
+    if (index_lookup(&bulk->groups, fields[0])) {
+	fprintf(stderr, "%s:%u: group \"%s\" already exists\n", bulk->file, bulk->line, fields[0]);
+	return 1;
+    }
+
+    gr.gr_name=fields[0];
+    gr.gr_passwd="x";
+    gr.gr_gid=parse_bulk_id(fields[1]);
+    if (gr.gr_gid==(gid_t)-1) {
+	fprintf(stderr, "%s:%u: invalid gid \"%s\"\n", bulk->file, bulk->line, safestr(fields[1]));
+	return 1;
+    }
+    gr.gr_mem=members=split_members(fields[2]);
+
+    node=new_group_node(&gr);
+    node->id=gr.gr_gid;
+    free(members);
+    log_decision("group-add", node, NULL, NULL, 1);
+    if (opt_verbose && !log_stream)
+	printf("Adding group \"%s\" (%u)\n", node->name, node->id);
+    insert_node(&system_groups, node, index_lookup(&bulk->groups, "+"));
+    index_add(&bulk->groups, node);
+    bulk_index_gid(bulk, node);
+    flag_dirty++;
+
+    return 0;
+}
+
+
+/* Remove a group given in a bulk spec.  Whether it is still some user's
+ * primary group is only known once the whole spec has been applied, so
+ * that is left to check_bulk_gids.
+ */
+int bulk_group_remove(struct _bulk* bulk, char** fields) {
+    struct _node*	node=index_lookup(&bulk->groups, fields[0]);
+    struct _bulk_gid*	dropped;
+
+    if (node==NULL) {
+	fprintf(stderr, "%s:%u: group \"%s\" does not exist\n", bulk->file, bulk->line, fields[0]);
+	return 1;
+    }
+
+    bulk_unindex_gid(bulk, node);
+    dropped=bulk_gid(bulk, node);
+    dropped->line=bulk->line;
+    nodelist_append(&bulk->dropped, &dropped->n);
+
+    log_decision("group-remove", node, NULL, NULL, 1);
+    if (opt_verbose && !log_stream)
+	printf("Removing group \"%s\" (%u)\n", node->name, node->id);
+    remove_node(&system_groups, node);
+    index_remove(&bulk->groups, node);
+    flag_dirty++;
+
+    return 0;
+}
+
+
+/* Change the gid or the members of a group given in a bulk spec.
+ */
+int bulk_group_change(struct _bulk* bulk, char** fields) {
+    struct _node*	node=index_lookup(&bulk->groups, fields[0]);
+    const char*		field=fields[1];
+
+    if (node==NULL) {
+	fprintf(stderr, "%s:%u: group \"%s\" does not exist\n", bulk->file, bulk->line, fields[0]);
+	return 1;
+    }
+
+    if (field!=NULL && strcmp(field, "gid")==0) {
+	gid_t	gid=parse_bulk_id(fields[2]);
+
+	if (gid==(gid_t)-1) {
+	    fprintf(stderr, "%s:%u: invalid gid \"%s\"\n", bulk->file, bulk->line, safestr(fields[2]));
+	    return 1;
+	}
+	log_id_decision("group-change-gid", node, node->id, gid, 1);
+	if (opt_verbose && !log_stream)
+	    printf("Changing gid of %s from %u to %u\n", node->name, node->id, gid);
+	note_renumbered(&renumbered_groups, node, node->id);
+	bulk_unindex_gid(bulk, node);
+	node->id=GR(node)->gr_gid=gid;
+	bulk_index_gid(bulk, node);
+    } else if (field!=NULL && strcmp(field, "members")==0) {
+	char*		old=join_members(GR(node)->gr_mem);
+	char**		members;
+	int		i;
+
+	if (opt_verbose && !log_stream)
+	    printf("Changing members of %s from \"%s\" to \"%s\"\n", node->name, old, safestr(fields[2]));
+	members=split_members(fields[2]);
+	for (i=0; members[i]; i++)
+	    members[i]=xstrdup(members[i]);
+	log_member_changes(node, GR(node)->gr_mem, members);
+	GR(node)->gr_mem=members;
+	free(old);
+    } else {
+	fprintf(stderr, "%s:%u: unknown group field \"%s\"\n", bulk->file, bulk->line, safestr(field));
+	return 1;
+    }
+    flag_dirty++;
+
+    return 0;
+}
+
+
+/* Check that no user is left with a primary group the spec removed, once
+ * the users of renumbered groups have been moved along.  A gid that
+ * another group still has is fine.  Returns non-zero on problems.
+ */
+int check_bulk_gids(struct _bulk* bulk) {
+    struct _index	dropped;
+    struct _node*	walk;
+    struct _node*	ref;
+    char		gid[16];
+    size_t		i;
+    int			ret=0;
+
+    if (bulk->dropped.count==0)
+	return 0;
+
+    index_init(&dropped, bulk->dropped.count);
+    for (i=0; i<bulk->dropped.count; i++)
+	index_add(&dropped, bulk->dropped.nodes[i]);
+    for (walk=system_groups; walk && dropped.count; walk=walk->next) {
+	snprintf(gid, sizeof(gid), "%u", GR(walk)->gr_gid);
+	if ((ref=index_lookup(&dropped, gid))!=NULL)
+	    index_remove(&dropped, ref);
+    }
+
+    for (walk=system_accounts; walk && dropped.count; walk=walk->next) {
+	if (walk->name[0]=='+' || walk->name[0]=='-')
+	    continue;
+	snprintf(gid, sizeof(gid), "%u", PW(walk)->pw_gid);
+	if ((ref=index_lookup(&dropped, gid))!=NULL) {
+	    fprintf(stderr, "%s:%u: group \"%s\" is the primary group of user \"%s\"\n",
+		    bulk->file, ((struct _bulk_gid*)ref)->line,
+		    ((struct _bulk_gid*)ref)->group->name, walk->name);
+	    ret=1;
+	    break;
+	}
+    }
+
+    index_free(&dropped);
+    return ret;
+}
+
+
+/* Apply a spec file of account changes to the system databases.  Each
+ * line holds a command and its arguments, separated like the fields of a
+ * sysusers.d fragment:
+ *
+ *   user-add NAME UID GROUP GECOS HOME SHELL
+ *   user-remove NAME
+ *   user-change NAME uid|gid|gecos|home|shell VALUE
+ *   group-add NAME GID MEMBERS
+ *   group-remove NAME
+ *   group-change NAME gid|members VALUE
+ *
+ * All changes are applied to the lists in memory, so that any number of
+ * them costs a single locked rewrite of each file.  Nothing is written if
+ * any line fails.
+ */
+int apply_bulk_file(const char* file) {
+    static const struct {
+	const char*	command;
+	int		(*apply)(struct _bulk*, char**);
+    } commands[] = {
+	{ "user-add",		bulk_user_add },
+	{ "user-remove",	bulk_user_remove },
+	{ "user-change",	bulk_user_change },
+	{ "group-add",		bulk_group_add },
+	{ "group-remove",	bulk_group_remove },
+	{ "group-change",	bulk_group_change },
+	{ NULL, NULL }
+    };
+    struct _bulk	bulk;
+    FILE*		input;
+    char*		line=NULL;
+    size_t		size=0;
+    struct _node*	walk;
+    size_t		i;
+    size_t		kept;
+    int			ret=0;
+
+    if ((input=fopen(file, "r"))==NULL) {
+	fprintf(stderr, "Error opening bulk spec %s: %s\n", file, strerror(errno));
+	return 1;
+    }
+
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.file=file;
+    bulk.line=0;
+    index_build(&bulk.users, system_accounts);
+    index_build(&bulk.groups, system_groups);
+    index_init(&bulk.gids, bulk.groups.count);
+    for (walk=system_groups; walk; walk=walk->next)
+	bulk_index_gid(&bulk, walk);
+    index_init(&bulk.added, 0);
+    index_init(&bulk.removed, 0);
+
+    while (ret==0 && getline(&line, &size, input)!=-1) {
+	char*	p=line;
+	char*	command=NULL;
+	char*	fields[6];
+	int	i;
+
+	bulk.line++;
+	if (!next_sysusers_field(&p, &command))
+	    continue;
+	memset(fields, 0, sizeof(fields));
+	for (i=0; i<6 && next_sysusers_field(&p, &fields[i]); i++)
+	    ;
+
+	for (i=0; commands[i].command; i++)
+	    if (command && strcmp(command, commands[i].command)==0)
+		break;
+	if (commands[i].command==NULL) {
+	    fprintf(stderr, "%s:%u: unknown command \"%s\"\n", file, bulk.line, safestr(command));
+	    ret=1;
+	} else if (fields[0]==NULL) {
+	    fprintf(stderr, "%s:%u: missing name\n", file, bulk.line);
+	    ret=1;
+	} else
+	    ret=commands[i].apply(&bulk, fields);
+    }
+
+    if (ret==0 && bulk.removed.count)
+	for (walk=system_groups; walk; walk=walk->next) {
+	    char**	members=GR(walk)->gr_mem;
+	    int		from, to;
+
+	    for (from=to=0; members[from]; from++)
+		if (index_lookup(&bulk.removed, members[from])==NULL)
+		    members[to++]=members[from];
+		else {
+		    log_member(walk, members[from], 0);
+		    if (opt_verbose>2 && !log_stream)
+			printf("Removing user \"%s\" from group \"%s\"\n", members[from], walk->name);
+		}
+	    members[to]=NULL;
+	}
+
+    /* Users follow their primary group to its new gid, as in a regular
+     * run, before it is clear which removed groups are still in use.
+     */
+    if (ret==0) {
+	propagate_gids();
+	ret=check_bulk_gids(&bulk);
+    }
+
+    /* Users the spec both added and removed don't need a shadow entry */
+    for (i=kept=0; i<accounts_added.count; i++)
+	if (index_lookup(&bulk.users, accounts_added.nodes[i]->name)==accounts_added.nodes[i])
+	    accounts_added.nodes[kept++]=accounts_added.nodes[i];
+    accounts_added.count=kept;
+
+    free(line);
+    fclose(input);
+    index_free(&bulk.users);
+    index_free(&bulk.groups);
+    index_free(&bulk.gids);
+    index_free(&bulk.added);
+    index_free(&bulk.removed);
+    for (i=0; i<bulk.gid_nodes.count; i++) {
+	free((char*)bulk.gid_nodes.nodes[i]->name);
+	free(bulk.gid_nodes.nodes[i]);
+    }
+    free(bulk.gid_nodes.nodes);
+    free(bulk.dropped.nodes);
+
+    return ret;
+}
+
+
+/* A home directory or shell referenced from passwd.  Each distinct path
+ * is checked once, however many users share it.
+ */
+struct _path {
+    struct _node	n;		/* the name is the path */
+    const char*		user;		/* the first user referring to it */
+    unsigned long	users;
+    int			err;		/* errno from stat, 0 if it worked */
+    mode_t		mode;
+};
+
+/* The paths to check, handed out to the threads in order */
+struct _path_pool {
+    struct _nodelist	paths;
+    size_t		next;
+    pthread_mutex_t	lock;
+};
+
+
+/* Add a reference to a path to the set of paths to check.
+ */
+void intern_path(struct _index* index, struct _nodelist* list, const char* name, const char* user) {
+    struct _path*	path;
+
+    if (name==NULL || *name=='\0')
+	return;
+
+    if ((path=(struct _path*)index_lookup(index, name))==NULL) {
+	path=xmalloc(sizeof(struct _path));
+	memset(path, 0, sizeof(struct _path));
+	path->n.name=name;
+	path->user=user;
+	index_add(index, &path->n);
+	nodelist_append(list, &path->n);
+    }
+    path->users++;
+    stats.path_references++;
+}
+
+
+/* Stat paths from the pool until there are none left.  Paths are taken
+ * a batch at a time to keep the threads from contending for the lock.
+ */
+void* check_paths_worker(void* arg) {
+    struct _path_pool*	pool=arg;
+    struct _path*	path;
+    struct stat		st;
+    size_t		first;
+    size_t		last;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	first=pool->next;
+	last=first+CHECK_PATHS_BATCH;
+	if (last>pool->paths.count)
+	    last=pool->paths.count;
+	pool->next=last;
+	pthread_mutex_unlock(&pool->lock);
+	if (first==last)
+	    return NULL;
+
+	for (; first<last; first++) {
+	    path=(struct _path*)pool->paths.nodes[first];
+	    if (stat(path->n.name, &st)==0)
+		path->mode=st.st_mode;
+	    else
+		path->err=errno;
+	}
+    }
+}
+
+
+/* Report a path that failed its check.
+ */
+void report_path(const struct _path* path, const char* what, const char* problem) {
+    if (path->users>1)
+	fprintf(stderr, "%s %s of user \"%s\" and %lu others: %s\n", what, path->n.name, path->user, path->users-1, problem);
+    else
+	fprintf(stderr, "%s %s of user \"%s\": %s\n", what, path->n.name, path->user, problem);
+}
+
+
+/* Check that the home directories and shells of all accounts exist.  The
+ * homes and shells are first reduced to their distinct values, which are
+ * then stat'ed by a pool of threads; the calls mostly wait for the disk or
+ * the network, so there are more threads than CPUs.  Returns the number
+ * of problems found.
+ */
+int check_paths() {
+    struct _index	homes;
+    struct _index	shells;
+    struct _path_pool	pool;
+    pthread_t		threads[IO_THREADS];
+    size_t		nthreads;
+    size_t		nhomes;
+    struct _node*	walk;
+    struct timespec	start;
+    size_t		i;
+    int			problems=0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    index_init(&homes, 0);
+    index_init(&shells, 0);
+
+    /* Homes first, then shells, so that they can be told apart later
+     * without a flag in every entry.
+     */
+    for (walk=system_accounts; walk; walk=walk->next)
+	if (walk->name[0]!='+' && walk->name[0]!='-' &&
+		strcmp(safestr(PW(walk)->pw_dir), NONEXISTENT_HOME)!=0)
+	    intern_path(&homes, &pool.paths, PW(walk)->pw_dir, walk->name);
+    nhomes=pool.paths.count;
+    for (walk=system_accounts; walk; walk=walk->next)
+	if (walk->name[0]!='+' && walk->name[0]!='-')
+	    intern_path(&shells, &pool.paths, PW(walk)->pw_shell, walk->name);
+
+    nthreads=pool.paths.count<IO_THREADS ? pool.paths.count : IO_THREADS;
+    for (i=1; i<nthreads; i++)
+	if (pthread_create(&threads[i], NULL, check_paths_worker, &pool)!=0)
+	    break;
+    nthreads=i;
+    check_paths_worker(&pool);
+    for (i=1; i<nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    for (i=0; i<pool.paths.count; i++) {
+	struct _path*	path=(struct _path*)pool.paths.nodes[i];
+	const char*	what=(i<nhomes) ? "Home directory" : "Shell";
+
+	if (path->err!=0)
+	    report_path(path, what, strerror(path->err));
+	else if (i<nhomes && !S_ISDIR(path->mode))
+	    report_path(path, what, "not a directory");
+	else if (i>=nhomes && (!S_ISREG(path->mode) || (path->mode&0111)==0))
+	    report_path(path, what, "not an executable file");
+	else
+	    continue;
+	problems++;
+    }
+
+    stats.paths_checked=pool.paths.count;
+    stats.path_seconds=elapsed_since(&start);
+
+    for (i=0; i<pool.paths.count; i++)
+	free(pool.paths.nodes[i]);
+    free(pool.paths.nodes);
+    pthread_mutex_destroy(&pool.lock);
+    index_free(&homes);
+    index_free(&shells);
+
+    return problems;
+}
+
+
+/* An id that changed, and what it changed to */
+struct _idpair {
+    uid_t	old_id;
+    uid_t	new_id;
+};
+
+/* An open directory waiting to be read, with its path for messages */
+struct _chown_dir {
+    int		fd;
+    char*	path;
+};
+
+/* The state shared by the threads re-owning the files of one tree.  Open
+ * directories wait on a stack for a thread to read them.  Files with more
+ * than one link are remembered by device and inode, so that each of them
+ * is re-owned only once.
+ */
+struct _chown_walk {
+    struct _idpair*	uids;
+    size_t		nuids;
+    struct _idpair*	gids;
+    size_t		ngids;
+    dev_t		dev;
+    struct _index	links;
+    struct _nodelist	linked;
+    struct _chown_dir	stack[CHOWN_STACK_SIZE];
+    size_t		depth;
+    int			busy;
+    unsigned long	scanned;
+    unsigned long	changed;
+    unsigned long	errors;
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+};
+
+
+int compare_idpairs(const void* a, const void* b) {
+    uid_t	x=((const struct _idpair*)a)->old_id;
+    uid_t	y=((const struct _idpair*)b)->old_id;
+
+    return (x>y)-(x<y);
+}
+
+
+/* Turn a list of renumbered entries into a sorted id mapping.  Returns
+ * newly allocated memory.
+ */
+struct _idpair* build_idpairs(const struct _renumberings* list, size_t* count) {
+    struct _idpair*	pairs=xmalloc(list->count*sizeof(struct _idpair));
+    size_t		i;
+
+    for (i=0; i<list->count; i++) {
+	pairs[i].old_id=list->entries[i].old_id;
+	pairs[i].new_id=list->entries[i].node->id;
+    }
+    qsort(pairs, list->count, sizeof(struct _idpair), compare_idpairs);
+    *count=list->count;
+
+    return pairs;
+}
+
+
+/* Look up what an id changed to.  Returns (uid_t)-1, which fchownat takes
+ * as "leave alone", if it didn't change.
+ */
+uid_t map_id(const struct _idpair* pairs, size_t count, uid_t id) {
+    struct _idpair	key;
+    struct _idpair*	pair;
+
+    key.old_id=id;
+    pair=bsearch(&key, pairs, count, sizeof(struct _idpair), compare_idpairs);
+    return pair ? pair->new_id : (uid_t)-1;
+}
+
+
+/* Check whether the owner or group of an inode was renumbered.
+ */
+int needs_chown(const struct _chown_walk* walk, const struct stat* st) {
+    return map_id(walk->uids, walk->nuids, st->st_uid)!=(uid_t)-1 ||
+	map_id(walk->gids, walk->ngids, st->st_gid)!=(gid_t)-1;
+}
+
+
+/* Give an inode the new ids of its owner and group, if they changed.  The
+ * inode is only ever reached through fd, which may be an O_PATH
+ * descriptor, so that nothing swapped in for its name in the meantime
+ * can be changed instead.  Changing the owner clears the set-id bits of a
+ * file, so those are restored.  Returns 1 if the inode was changed.
+ */
+int chown_entry(struct _chown_walk* walk, int fd, const char* path, const struct stat* st) {
+    uid_t	uid=map_id(walk->uids, walk->nuids, st->st_uid);
+    gid_t	gid=map_id(walk->gids, walk->ngids, st->st_gid);
+    char	proc[32];
+
+    if (uid==(uid_t)-1 && gid==(gid_t)-1)
+	return 0;
+
+    if (fchownat(fd, "", uid, gid, AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW)!=0) {
+	fprintf(stderr, "Failed to change owner of %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+
+    /* An O_PATH descriptor can't be fchmod'ed, but the inode it refers
+     * to can be reached through /proc without looking its name up again.
+     */
+    if (S_ISREG(st->st_mode) && (st->st_mode&(S_ISUID|S_ISGID))) {
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	if (chmod(proc, st->st_mode&07777)!=0)
+	    fprintf(stderr, "Failed to restore the mode of %s: %s\n", path, strerror(errno));
+    }
+
+    return 1;
+}
+
+
+/* Check whether this is the first link to a file that was found.  A file
+ * that is reached again through another link already has its new ids,
+ * which may well be old ids of another entry.
+ */
+int first_link(struct _chown_walk* walk, const struct stat* st) {
+    struct _node*	node;
+    char*		key;
+    int			first=0;
+
+    if (S_ISDIR(st->st_mode) || st->st_nlink<2)
+	return 1;
+
+    key=xasprintf("%lx:%lx", (unsigned long)st->st_dev, (unsigned long)st->st_ino);
+    pthread_mutex_lock(&walk->lock);
+    if (index_lookup(&walk->links, key)==NULL) {
+	node=xmalloc(sizeof(struct _node));
+	memset(node, 0, sizeof(struct _node));
+	node->name=key;
+	index_add(&walk->links, node);
+	nodelist_append(&walk->linked, node);
+	first=1;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    if (!first)
+	free(key);
+
+    return first;
+}
+
+
+/* Offer an open directory to the other threads.  Returns 0 if there is
+ * no room left, in which case the caller has to read it itself; this
+ * bounds the number of open directories.
+ */
+int push_directory(struct _chown_walk* walk, int fd, char* path) {
+    int		ret=0;
+
+    pthread_mutex_lock(&walk->lock);
+    if (walk->depth<CHOWN_STACK_SIZE) {
+	walk->stack[walk->depth].fd=fd;
+	walk->stack[walk->depth].path=path;
+	walk->depth++;
+	pthread_cond_signal(&walk->cond);
+	ret=1;
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    return ret;
+}
+
+
+/* Re-own the entries of a directory and queue its subdirectories.  Mount
+ * points and symbolic links are never followed.  Entries are stat'ed by
+ * name, and those that need changing or reading are then opened without
+ * following symbolic links; all further work goes through that
+ * descriptor, after checking that it still is the inode stat'ed.  Takes
+ * over fd and path.
+ */
+void chown_directory(struct _chown_walk* walk, int fd, char* path) {
+    DIR*		dir;
+    struct dirent*	entry;
+    struct stat		st;
+    struct stat		fst;
+    char*		name;
+    int			entry_fd;
+    unsigned long	scanned=0;
+    unsigned long	changed=0;
+    unsigned long	errors=0;
+    int			child;
+    int			ret;
+
+    if ((dir=fdopendir(fd))==NULL) {
+	fprintf(stderr, "Failed to read directory %s: %s\n", path, strerror(errno));
+	close(fd);
+	errors++;
+    } else {
+	while ((entry=readdir(dir))!=NULL) {
+	    if (strcmp(entry->d_name, ".")==0 || strcmp(entry->d_name, "..")==0)
+		continue;
+	    name=xasprintf("%s/%s", path, entry->d_name);
+	    if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW)!=0) {
+		fprintf(stderr, "Failed to check %s: %s\n", name, strerror(errno));
+		errors++;
+		free(name);
+		continue;
+	    }
+	    scanned++;
+
+	    if (st.st_dev!=walk->dev || (!S_ISDIR(st.st_mode) && !needs_chown(walk, &st))) {
+		free(name);
+		continue;
+	    }
+
+	    entry_fd=openat(fd, entry->d_name, O_PATH|O_NOFOLLOW|O_CLOEXEC);
+	    if (entry_fd==-1 || fstat(entry_fd, &fst)!=0) {
+		fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+		if (entry_fd!=-1)
+		    close(entry_fd);
+		errors++;
+		free(name);
+		continue;
+	    }
+	    if (fst.st_dev!=st.st_dev || fst.st_ino!=st.st_ino) {
+		fprintf(stderr, "Not changing %s: it was replaced while we checked it\n", name);
+		close(entry_fd);
+		errors++;
+		free(name);
+		continue;
+	    }
+
+	    if (!first_link(walk, &fst))
+		ret=0;
+	    else if ((ret=chown_entry(walk, entry_fd, name, &fst))<0)
+		errors++;
+	    else
+		changed+=ret;
+
+	    if (!S_ISDIR(fst.st_mode)) {
+		close(entry_fd);
+		free(name);
+		continue;
+	    }
+	    child=openat(entry_fd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	    close(entry_fd);
+	    if (child==-1) {
+		fprintf(stderr, "Failed to open directory %s: %s\n", name, strerror(errno));
+		errors++;
+		free(name);
+	    } else if (!push_directory(walk, child, name))
+		chown_directory(walk, child, name);
+	}
+	closedir(dir);
+    }
+    free(path);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->scanned+=scanned;
+    walk->changed+=changed;
+    walk->errors+=errors;
+    pthread_mutex_unlock(&walk->lock);
+}
+
+
+/* Take directories from the stack until it is empty and no other thread
+ * can add more.
+ */
+void* chown_worker(void* arg) {
+    struct _chown_walk*	walk=arg;
+    struct _chown_dir	next;
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;) {
+	while (walk->depth==0 && walk->busy>0)
+	    pthread_cond_wait(&walk->cond, &walk->lock);
+	if (walk->depth==0)
+	    break;
+
+	next=walk->stack[--walk->depth];
+	walk->busy++;
+	pthread_mutex_unlock(&walk->lock);
+	chown_directory(walk, next.fd, next.path);
+	pthread_mutex_lock(&walk->lock);
+	if (--walk->busy==0 && walk->depth==0)
+	    pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_mutex_unlock(&walk->lock);
+
+    return NULL;
+}
+
+
+/* Give the files in the trees given with --chown-tree the new ids of the
+ * users and groups that were renumbered, the way chown -R would, but
+ * reading many directories at once and without leaving the file system
+ * each tree is on.  Returns the number of errors.
+ */
+unsigned long migrate_ownership() {
+    struct _chown_walk	walk;
+    pthread_t		threads[IO_THREADS];
+    struct timespec	start;
+    struct stat		st;
+    int			nthreads;
+    int			fd;
+    int			ret;
+    size_t		n;
+    int			i;
+    int			t;
+
+    if (renumbered_users.count==0 && renumbered_groups.count==0)
+	return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    memset(&walk, 0, sizeof(walk));
+    walk.uids=build_idpairs(&renumbered_users, &walk.nuids);
+    walk.gids=build_idpairs(&renumbered_groups, &walk.ngids);
+    index_init(&walk.links, 0);
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+
+    for (i=0; i<chown_count; i++) {
+	if (opt_verbose)
+	    printf("Changing ownership of files in %s\n", chown_trees[i]);
+
+	if ((fd=open(chown_trees[i], O_RDONLY|O_DIRECTORY|O_CLOEXEC))==-1 || fstat(fd, &st)!=0) {
+	    fprintf(stderr, "Failed to open directory %s: %s\n", chown_trees[i], strerror(errno));
+	    if (fd!=-1)
+		close(fd);
+	    walk.errors++;
+	    continue;
+	}
+	walk.dev=st.st_dev;
+	walk.scanned++;
+	if ((ret=chown_entry(&walk, fd, chown_trees[i], &st))<0)
+	    walk.errors++;
+	else
+	    walk.changed+=ret;
+
+	walk.stack[0].fd=fd;
+	walk.stack[0].path=xstrdup(chown_trees[i]);
+	walk.depth=1;
+	for (nthreads=1; nthreads<IO_THREADS; nthreads++)
+	    if (pthread_create(&threads[nthreads], NULL, chown_worker, &walk)!=0)
+		break;
+	chown_worker(&walk);
+	for (t=1; t<nthreads; t++)
+	    pthread_join(threads[t], NULL);
+    }
+
+    stats.chown_scanned=walk.scanned;
+    stats.chown_changed=walk.changed;
+    stats.chown_seconds=elapsed_since(&start);
+    if (opt_verbose)
+	printf("Checked %lu files in %.3fs (%.0f per second), changed %lu\n",
+		walk.scanned, stats.chown_seconds,
+		walk.scanned/(stats.chown_seconds>0 ? stats.chown_seconds : 1), walk.changed);
+
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.cond);
+    for (n=0; n<walk.linked.count; n++) {
+	free((char*)walk.linked.nodes[n]->name);
+	free(walk.linked.nodes[n]);
+    }
+    free(walk.linked.nodes);
+    index_free(&walk.links);
+    free(walk.uids);
+    free(walk.gids);
+
+    return walk.errors;
+}
+
+
+int write_passwd(const struct _node* passwd, const char* file) {
+    FILE*	output;
+
+    if (opt_verbose>2)
+	printf("Writing passwd-file to %s\n", file);
+
+    if ((output=fopen(file, "wt"))==NULL) {
+	fprintf(stderr, "Failed to open passwd-file %s for writing: %s\n",
+		file, strerror(errno));
+	return 0;
+    }
+
+    for (;passwd; passwd=passwd->next) {
+	if (fputpwent(PW(passwd), output)!=0) {
+	    fprintf(stderr, "Error writing passwd-entry: %s\n", strerror(errno));
+	    return 0;
+	}
+    }
+
+    if (fclose(output)!=0) {
+	fprintf(stderr, "Error closing passwd-file: %s\n", strerror(errno));
+	return 0;
+    }
+
+    return 1;
+}
+
+
+int write_shadow(const struct _node* shadow, const char* file) {
+    FILE*	output;
+
+    if (opt_verbose>2)
+	printf("Writing shadow-file to %s\n", file);
+
+    if ((output=fopen(file, "wt"))==NULL) {
+	fprintf(stderr, "Failed to open shadow-file %s for writing: %s\n",
+	       	file, strerror(errno));
+	return 0;
+    }
+
+    for (;shadow; shadow=shadow->next) {
+	if (putspent(SP(shadow), output)!=0) {
+	    fprintf(stderr, "Error writing shadow-entry: %s\n", strerror(errno));
+	    return 0;
+	}
+    }
+
+    if (fclose(output)!=0) {
+	fprintf(stderr, "Error closing shadow-file: %s\n", strerror(errno));
+	return 0;
+    }
+
+    return 1;
+}
+
+
+#ifndef HAVE_PUTGRENT
+int putgrent(const struct group* g, FILE* f) {
+    int idx;
+    fprintf(f, "%s:%s:%u:", g->gr_name, g->gr_passwd, g->gr_gid);
+    if (g->gr_mem)
+	for (idx=0; g->gr_mem[idx]; idx++)
+	    fprintf(f, ((idx==0) ? "%s" : ",%s"), g->gr_mem[idx]);
     fprintf(f, "\n");
     return fflush(f);
 }
 #endif
 
 
-int write_group(const struct _node* group, const char* file) {
-    FILE*	output;
+int write_group(const struct _node* group, const char* file) {
+    FILE*	output;
+
+    if (opt_verbose>2)
+	printf("Writing group-file to %s\n", file);
+
+    if ((output=fopen(file, "wt"))==NULL) {
+	fprintf(stderr, "Failed to open group-file %s for writing: %s\n",
+		file, strerror(errno));
+	return 0;
+    }
+
+    for (;group; group=group->next) {
+	if (putgrent(GR(group), output)!=0) {
+	    fprintf(stderr, "Error writing group-entry: %s\n", strerror(errno));
+	    return 0;
+	}
+    }
+
+    if (fclose(output)!=0) {
+	fprintf(stderr, "Error closing group-file: %s\n", strerror(errno));
+	return 0;
+    }
+
+    return 1;
+}
+
+
+/* A pseudonym given to a name by --anonymize.  The list header carries the
+ * original name so pseudonyms can be found through an index.
+ */
+struct _alias {
+    struct _node	n;
+    char*		alias;
+};
+
+/* State for --anonymize: the pseudonyms handed out so far, indexed both by
+ * original name and by pseudonym, the names to keep, and the random key
+ * that makes pseudonyms impossible to recompute from a list of names.
+ */
+struct _anonymizer {
+    struct _index	originals;
+    struct _index	aliases;
+    struct _index	keep;
+    unsigned long	key;
+};
+
+/* Attempts at a pseudonym of the same length as the name before we make
+ * it longer, which only happens for short names once most pseudonyms of
+ * their length are taken.
+ */
+#define ANON_ATTEMPTS	64
+
+const char	anon_alnum[]="abcdefghijklmnopqrstuvwxyz0123456789";
+const char	anon_crypt[]="./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+
+/* Keyed hash of a string and a retry counter
+ */
+unsigned long anon_hash(const struct _anonymizer* anon, const char* str, unsigned attempt) {
+    unsigned long	hash=anon->key^(attempt*0x9e3779b9UL);
+
+    for (; *str; str++) {
+	hash^=(unsigned char)*str;
+	hash*=16777619UL;
+	hash^=hash>>15;
+    }
+
+    return hash;
+}
+
+
+/* Remember a pseudonym for a name.  The same record is indexed under the
+ * original name and under the pseudonym, through two headers.
+ */
+const char* anon_remember(struct _anonymizer* anon, const char* name, char* pseudonym) {
+    struct _alias*	alias=xmalloc(sizeof(struct _alias));
+    struct _node*	found;
+
+    alias->alias=pseudonym;
+    alias->n.name=xstrdup(name);
+    index_add(&anon->originals, &alias->n);
+    found=xmalloc(sizeof(struct _node));
+    found->name=pseudonym;
+    index_add(&anon->aliases, found);
+
+    return pseudonym;
+}
+
+
+/* Return the pseudonym for a name, creating one if needed.  Pseudonyms have
+ * the same length as the name and keep its punctuation, start with a
+ * letter, and never clash with another pseudonym or a name that is kept.
+ * When no such pseudonym can be found they get longer.  Names of master
+ * entries are kept as they are; NIS compat entries keep their + or -
+ * marker, and the @ of a netgroup, but not the name after it.
+ */
+const char* anon_name(struct _anonymizer* anon, const char* name) {
+    struct _node*	found;
+    char*		pseudonym;
+    unsigned		attempt;
+    size_t		i, len, namelen;
+
+    if (name==NULL || index_lookup(&anon->keep, name))
+	return name;
+    if ((found=index_lookup(&anon->originals, name))!=NULL)
+	return ((struct _alias*)found)->alias;
+
+    if (name[0]=='+' || name[0]=='-') {
+	size_t		marker=(name[1]=='@') ? 2 : 1;
+	const char*	rest;
+
+	if (name[marker]=='\0')
+	    return name;
+	rest=anon_name(anon, name+marker);
+	pseudonym=xasprintf("%.*s%s", (int)marker, name, rest);
+	return anon_remember(anon, name, pseudonym);
+    }
+
+    len=namelen=strlen(name);
+    pseudonym=xmalloc(len+1);
+
+    for (attempt=0; ; attempt++) {
+	unsigned long	hash;
+
+	if (attempt && (attempt%ANON_ATTEMPTS)==0)
+	    pseudonym=xrealloc(pseudonym, ++len+1);
+	pseudonym[len]='\0';
+
+	hash=anon_hash(anon, name, attempt);
+	for (i=0; i<len; i++) {
+	    if (i && (i%6)==0)
+		hash=anon_hash(anon, name, attempt+(i<<16));
+	    if (i<namelen && !isalnum((int)name[i]))
+		pseudonym[i]=name[i];
+	    else if (i==0)
+		pseudonym[i]=anon_alnum[hash%26];
+	    else
+		pseudonym[i]=anon_alnum[hash%36];
+	    hash/=36;
+	}
+	if (index_lookup(&anon->aliases, pseudonym)==NULL &&
+		index_lookup(&anon->keep, pseudonym)==NULL)
+	    break;
+    }
+
+    return anon_remember(anon, name, pseudonym);
+}
+
+
+/* Replace every letter of a GECOS field by x or X and every digit by 0,
+ * keeping its length and the comma separated structure.
+ */
+char* anon_gecos(const char* gecos) {
+    char*	copy=xstrdup(gecos);
+    char*	p;
+
+    for (p=copy; p && *p; p++)
+	if (isdigit((int)*p))
+	    *p='0';
+	else if (isupper((int)*p))
+	    *p='X';
+	else if (isalpha((int)*p))
+	    *p='x';
+    return copy;
+}
+
+
+/* Replace the components of a home directory that are the name of a user
+ * by that user's pseudonym.  Returns newly allocated memory.
+ */
+char* anon_path(struct _anonymizer* anon, const char* path) {
+    char*	copy=xstrdup(path);
+    char*	result;
+    char*	start;
+    size_t	len;
+
+    if (copy==NULL)
+	return NULL;
+
+    /* Pseudonyms can be longer than the names they replace */
+    result=xmalloc(1);
+    result[0]='\0';
+    len=0;
+    for (start=copy; ; ) {
+	char*		end=strchr(start, '/');
+	struct _node*	found;
+	const char*	part=start;
+
+	if (end)
+	    *end='\0';
+	if ((found=index_lookup(&anon->originals, start))!=NULL)
+	    part=((struct _alias*)found)->alias;
+	result=xrealloc(result, len+strlen(part)+2);
+	len+=sprintf(result+len, "%s%s", part, end ? "/" : "");
+	if (!end)
+	    break;
+	start=end+1;
+    }
+
+    free(copy);
+    return result;
+}
+
+
+/* Replace the salt and hash of a password by random characters of the
+ * same alphabet, keeping the length, the $id$ prefix and the markers for
+ * locked or disabled passwords.
+ */
+char* anon_password(const char* password) {
+    char*	copy=xstrdup(password);
+    char*	p;
+
+    if (copy==NULL || strcmp(copy, "x")==0)
+	return copy;
+
+    p=copy+strspn(copy, "!*");
+    if (*p=='$' && strchr(p+1, '$')!=NULL)
+	p=strchr(p+1, '$')+1;
+    for (; *p; p++)
+	if (*p!='$')
+	    *p=anon_crypt[random()%(sizeof(anon_crypt)-1)];
+
+    return copy;
+}
 
-    if (opt_verbose>2)
-	printf("Writing group-file to %s\n", file);
 
-    if ((output=fopen(file, "wt"))==NULL) {
-	fprintf(stderr, "Failed to open group-file %s for writing: %s\n",
-		file, strerror(errno));
+/* Write pseudonymized copies of the system passwd, group and shadow files
+ * to a directory, for use as realistic test data.  Names, GECOS fields,
+ * home directories named after users and password hashes are replaced
+ * consistently across the three files; ids, the names of master entries,
+ * group membership structure and the length of every field are kept.
+ * Passwords are replaced for every entry, as even a master entry may
+ * have a real one.
+ */
+int anonymize_files(const char* dir) {
+    struct _anonymizer	anon;
+    struct _node*	walk;
+    struct _node*	shadow=NULL;
+    char*		file;
+    int			fd;
+    int			ret=1;
+
+    index_build(&anon.keep, master_accounts);
+    for (walk=master_groups; walk; walk=walk->next)
+	index_add(&anon.keep, walk);
+    index_init(&anon.originals, 0);
+    index_init(&anon.aliases, 0);
+    anon.key=time(NULL)^getpid();
+    if ((fd=open("/dev/urandom", O_RDONLY))!=-1) {
+	if (read(fd, &anon.key, sizeof(anon.key))!=sizeof(anon.key))
+	    anon.key^=(unsigned long)&anon;
+	close(fd);
+    }
+    srandom(anon.key);
+
+    if (read_shadow(&shadow, sys_shadow)!=0 && errno!=ENOENT)
 	return 0;
+
+    /* Give out pseudonyms for users first, so that home directories can
+     * refer to them.
+     */
+    for (walk=system_accounts; walk; walk=walk->next)
+	anon_name(&anon, walk->name);
+
+    for (walk=system_accounts; walk; walk=walk->next) {
+	struct passwd*	pw=PW(walk);
+
+	walk->name=pw->pw_name=(char*)anon_name(&anon, pw->pw_name);
+	pw->pw_passwd=anon_password(pw->pw_passwd);
+	pw->pw_gecos=anon_gecos(pw->pw_gecos);
+	pw->pw_dir=anon_path(&anon, pw->pw_dir);
     }
 
-    for (;group; group=group->next) {
-	assert(group->t==t_group);
-	if (putgrent(&(group->d.gr), output)!=0) {
-	    fprintf(stderr, "Error writing group-entry: %s\n", strerror(errno));
-	    return 0;
-	}
+    for (walk=shadow; walk; walk=walk->next) {
+	struct spwd*	sp=SP(walk);
+
+	walk->name=sp->sp_namp=(char*)anon_name(&anon, sp->sp_namp);
+	sp->sp_pwdp=anon_password(sp->sp_pwdp);
     }
 
-    if (fclose(output)!=0) {
-	fprintf(stderr, "Error closing group-file: %s\n", strerror(errno));
-	return 0;
+    for (walk=system_groups; walk; walk=walk->next) {
+	struct group*	gr=GR(walk);
+	char**		mem;
+
+	walk->name=gr->gr_name=(char*)anon_name(&anon, gr->gr_name);
+	gr->gr_passwd=anon_password(gr->gr_passwd);
+	for (mem=gr->gr_mem; *mem; mem++)
+	    *mem=(char*)anon_name(&anon, *mem);
     }
 
-    return 1;
+    if (opt_verbose)
+	printf("Pseudonymized %lu names\n", (unsigned long)anon.originals.count);
+
+    if (opt_dryrun) {
+	printf("Would write pseudonymized files to %s\n", dir);
+	return 1;
+    }
+
+    umask(0077);
+
+    file=xasprintf("%s/passwd", dir);
+    if (!write_passwd(system_accounts, file))
+	ret=0;
+    free(file);
+    file=xasprintf("%s/group", dir);
+    if (!write_group(system_groups, file))
+	ret=0;
+    free(file);
+    if (shadow) {
+	file=xasprintf("%s/shadow", dir);
+	if (!write_shadow(shadow, file))
+	    ret=0;
+	free(file);
+    }
+
+    return ret;
+}
+
+
+/* With --pipeline the system passwd file is prefetched on a thread while
+ * the group file is read, and each database is written on its own thread,
+ * so that the I/O and parsing or formatting of the files overlap.  This is
+ * not a pipeline of stages: all reads are finished before anything is
+ * compared or decided, and the writes only start once everything is.
+ * Every job has its own list and stdio buffer.  Without --pipeline the
+ * same jobs simply run inline.
+ */
+struct _read_job {
+    int			(*reader)(struct _node**, const char*);
+    struct _node**	list;
+    const char*		file;
+    int			ret;
+    int			err;
+    int			threaded;
+    pthread_t		thread;
+    struct _ops		ops;
+};
+
+struct _write_job {
+    int			(*writer)(const struct _node*, const char*);
+    const struct _node*	list;
+    const char*		target;
+    char*		file;
+    int			ret;
+    int			threaded;
+    pthread_t		thread;
+};
+
+
+void* run_read_job(void* arg) {
+    struct _read_job*	job=arg;
+
+    job->ret=job->reader(job->list, job->file);
+    job->err=errno;
+    job->ops=ops;
+    return NULL;
+}
+
+
+void* run_write_job(void* arg) {
+    struct _write_job*	job=arg;
+
+    job->ret=job->writer(job->list, job->file);
+    return NULL;
+}
+
+
+/* Start reading a database, on a separate thread if we are pipelining.
+ */
+void start_read_job(struct _read_job* job, int (*reader)(struct _node**, const char*), struct _node** list, const char* file) {
+    job->reader=reader;
+    job->list=list;
+    job->file=file;
+    job->threaded=0;
+
+    if (opt_pipeline==1 && pthread_create(&job->thread, NULL, run_read_job, job)==0) {
+	job->threaded=1;
+	return;
+    }
+
+    run_read_job(job);
+}
+
+
+/* Wait for a read to finish.  Returns the result of the reader with errno
+ * set as the reader left it.
+ */
+int finish_read_job(struct _read_job* job) {
+    if (job->threaded) {
+	pthread_join(job->thread, NULL);
+	merge_ops(&job->ops);
+	job->threaded=0;
+    }
+
+    errno=job->err;
+    return job->ret;
+}
+
+
+/* Start writing a database to a temporary file next to its target.
+ */
+void start_write_job(struct _write_job* job, int (*writer)(const struct _node*, const char*), const struct _node* list, const char* target) {
+    job->writer=writer;
+    job->list=list;
+    job->target=target;
+    job->file=xasprintf("%s%s", target, WRITE_EXTENSION);
+    job->threaded=0;
+
+    if (opt_pipeline==1 && pthread_create(&job->thread, NULL, run_write_job, job)==0) {
+	job->threaded=1;
+	return;
+    }
+
+    run_write_job(job);
+}
+
+
+/* Wait for a write to finish.  Returns non-zero on success.
+ */
+int finish_write_job(struct _write_job* job) {
+    if (job->threaded) {
+	pthread_join(job->thread, NULL);
+	job->threaded=0;
+    }
+
+    return job->ret;
 }
 
 
@@ -1204,166 +4958,758 @@ int copy_filemodes(const char* source, const char* target) {
 }
 
 
-/* Atomically replace a file with another, possibly keeping a backup file.
- * Taken from the dpkg2 sourcetree.
+/* Atomically replace a file with another, possibly keeping a backup file.
+ * Taken from the dpkg2 sourcetree.
+ */
+int replace_file(const char* org, const char* new, const char* backup) {
+    if (backup) {
+	int res;
+
+	if ((res=link(org, backup))==-1) {
+	    if (errno==EEXIST) {
+		if (unlink(backup)==-1) {
+		    fprintf(stderr, "Error unlinking old backupfile %s: %s\n",
+			    backup, strerror(errno));
+		    return 0;
+		}
+		res=link(org, backup);
+	    }
+	    if (res==-1) {
+		fprintf(stderr, "Error making backupfile %s: %s\n", backup, strerror(errno));
+		return 0;
+	    }
+	}
+    }
+
+    if (rename(new, org)==-1) {
+	fprintf(stderr, "Error: failed to replace %s with %s: %s\n", org, new, strerror(errno));
+	return 0;
+    }
+
+    return 1;
+}
+
+
+/* Try to replace a file as safely as possible. If we fail unlink the
+ * new copy, since it's useless anyway.
+ */
+int put_file_in_place(const char* source, const char* target) {
+    char*	uf;
+    int		ret;
+
+    if (opt_verbose>2)
+	printf("Replacing \"%s\" with \"%s\"\n", target, source);
+
+    uf=xasprintf("%s%s", target, BACKUP_EXTENSION);
+
+    if (!copy_filemodes(target, source)) {
+	free(uf);
+	return 0;
+    }
+
+    ret=replace_file(target, source, uf);
+    free(uf);
+
+    return ret;
+}
+
+
+/* Put a subuid or subgid file in place.  Unlike the account databases
+ * these need not exist yet, in which case there is nothing to back up or
+ * take the modes from.
+ */
+int put_subid_file(const char* source, const char* target) {
+    if (access(target, F_OK)==0 || errno!=ENOENT)
+	return put_file_in_place(source, target);
+
+    if (opt_verbose>2)
+	printf("Creating \"%s\" from \"%s\"\n", target, source);
+    if (chmod(source, 0644)!=0) {
+	fprintf(stderr, "Error chmoding %s: %s\n", source, strerror(errno));
+	return 0;
+    }
+    return replace_file(target, source, NULL);
+}
+
+
+/* Limit the reconciliation to what changed since the master files that
+ * were last applied, if we have a copy of those in the state directory.
+ */
+int load_master_delta() {
+    struct _node*	old_accounts=NULL;
+    struct _node*	old_groups=NULL;
+    struct stat		st;
+    char*		passwd_file;
+    char*		group_file;
+    size_t		users, groups;
+    int			ret=0;
+
+    passwd_file=xasprintf("%s/passwd.master", opt_state_dir);
+    group_file=xasprintf("%s/group.master", opt_state_dir);
+
+    if (stat(passwd_file, &st)!=0 || stat(group_file, &st)!=0) {
+	if (opt_verbose)
+	    printf("No previously applied master files, checking everything\n");
+    } else if (read_passwd(&old_accounts, passwd_file)!=0 ||
+	    read_group(&old_groups, group_file)!=0)
+	ret=2;
+    else {
+	scope_accounts=xmalloc(sizeof(struct _index));
+	scope_groups=xmalloc(sizeof(struct _index));
+	users=build_scope(scope_accounts, old_accounts, master_accounts, 0);
+	groups=build_scope(scope_groups, old_groups, master_groups, 1);
+	if (opt_verbose)
+	    printf("Master files changed for %lu users and %lu groups since the last run\n",
+		    (unsigned long)users, (unsigned long)groups);
+    }
+
+    free(passwd_file);
+    free(group_file);
+
+    return ret;
+}
+
+
+/* Create a directory along with any missing parents, like mkdir -p.
+ */
+int make_directory(const char* dir) {
+    char*	path=xstrdup(dir);
+    char*	p;
+    char	c;
+    int		ret=1;
+
+    for (p=path+1; ret; p++) {
+	if (*p!='/' && *p!='\0')
+	    continue;
+	c=*p;
+	*p='\0';
+	if (mkdir(path, 0755)!=0 && errno!=EEXIST) {
+	    fprintf(stderr, "Warning: can't create directory %s: %s\n", path, strerror(errno));
+	    ret=0;
+	}
+	*p=c;
+	if (c=='\0')
+	    break;
+    }
+
+    free(path);
+    return ret;
+}
+
+
+/* Remember the master files we just applied, for the next run.  The state
+ * directory is created if needed.  Failing to save the state is not fatal,
+ * the next run merely checks all entries again.
+ */
+int save_master_state() {
+    char*	passwd_file;
+    char*	group_file;
+    char*	wf;
+    int		ret=0;
+
+    if (opt_dryrun)
+	return 1;
+
+    if (!make_directory(opt_state_dir))
+	return 0;
+
+    passwd_file=xasprintf("%s/passwd.master", opt_state_dir);
+    group_file=xasprintf("%s/group.master", opt_state_dir);
+
+    wf=xasprintf("%s%s", passwd_file, WRITE_EXTENSION);
+    if (write_passwd(master_accounts, wf) && rename_file(wf, passwd_file)) {
+	free(wf);
+	wf=xasprintf("%s%s", group_file, WRITE_EXTENSION);
+	if (write_group(master_groups, wf) && rename_file(wf, group_file))
+	    ret=1;
+    }
+
+    if (!ret) {
+	unlink(wf);
+	fprintf(stderr, "Warning: the master files were not saved in %s, the next run will check all entries\n", opt_state_dir);
+    }
+
+    free(wf);
+    free(passwd_file);
+    free(group_file);
+
+    return ret;
+}
+
+
+/* Rewrite the account-database if we made any changes.  All files are
+ * written out before any of them is put in place.
+ */
+int commit_files() {
+    struct _write_job	jobs[5+2*MAX_EXTRA_SETS];
+    int			njobs=0;
+    int			placed;
+    int			ret=1;
+    int			i;
+
+    if (!flag_dirty) {
+	if (opt_verbose)
+	    printf("No changes needed\n");
+	return 1;
+    }
+
+    if (opt_dryrun) {
+	printf("Would commit %d changes\n", flag_dirty);
+	return 1;
+    }
+
+    printf("%d changes have been made, rewriting files\n", flag_dirty);
+
+    if (opt_verbose==2)
+	printf("Writing passwd-file to %s\n", sys_passwd);
+    start_write_job(&jobs[njobs++], write_passwd, system_accounts, sys_passwd);
+
+    if (flag_shadow) {
+	if (opt_verbose==2)
+	    printf("Writing shadow-file to %s\n", sys_shadow);
+	start_write_job(&jobs[njobs++], write_shadow, system_shadow, sys_shadow);
+    }
+
+    if (opt_verbose==2)
+	printf("Writing group-file to %s\n", sys_group);
+    start_write_job(&jobs[njobs++], write_group, system_groups, sys_group);
+
+    for (i=0; i<extra_count; i++) {
+	if (!extra_sets[i].dirty)
+	    continue;
+	if (opt_verbose==2)
+	    printf("Writing passwd-file to %s\n", extra_sets[i].passwd);
+	start_write_job(&jobs[njobs++], write_passwd, extra_sets[i].accounts, extra_sets[i].passwd);
+	if (opt_verbose==2)
+	    printf("Writing group-file to %s\n", extra_sets[i].group);
+	start_write_job(&jobs[njobs++], write_group, extra_sets[i].groups, extra_sets[i].group);
+    }
+
+    for (i=0; i<2; i++) {
+	if (!subids[i].dirty)
+	    continue;
+	if (opt_verbose==2)
+	    printf("Writing %s-file to %s\n", subids[i].descr, subids[i].file);
+	start_write_job(&jobs[njobs++], write_subids, subids[i].ranges, subids[i].file);
+    }
+
+    for (i=0; i<njobs; i++)
+	if (!finish_write_job(&jobs[i]))
+	    ret=0;
+
+    for (placed=0; ret && placed<njobs; placed++)
+	if (!(jobs[placed].writer==write_subids ?
+		    put_subid_file(jobs[placed].file, jobs[placed].target) :
+		    put_file_in_place(jobs[placed].file, jobs[placed].target))) {
+	    ret=0;
+	    break;
+	}
+
+    /* Don't leave behind the new copies that didn't make it into place */
+    for (i=placed; i<njobs; i++)
+	if (unlink(jobs[i].file)!=0 && errno!=ENOENT)
+	    fprintf(stderr, "Error unlinking %s: %s\n", jobs[i].file, strerror(errno));
+
+    for (i=0; i<njobs; i++)
+	free(jobs[i].file);
+
+    return ret;
+}
+
+
+/* The lock taken on opt_lockfile instead of lckpwdf, if any */
+int		lock_fd		= -1;
+
+/* Try to lock the account database.  With --lock-file we take the same
+ * kind of lock lckpwdf takes on its lock file, but on a file of our
+ * choosing, so that tools working on copies of the databases can be
+ * serialized against each other.
+ */
+int lock_files() {
+    struct timespec	start;
+    struct flock	fl;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (opt_lockfile) {
+	if ((lock_fd=open(opt_lockfile, O_WRONLY|O_CREAT|O_CLOEXEC, 0600))==-1) {
+	    fprintf(stderr, "Error opening lock file %s: %s\n", opt_lockfile, strerror(errno));
+	    return 0;
+	}
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type=F_WRLCK;
+	fl.l_whence=SEEK_SET;
+	while (fcntl(lock_fd, F_SETLKW, &fl)==-1)
+	    if (errno!=EINTR) {
+		fprintf(stderr, "Error locking files: %s\n", strerror(errno));
+		close(lock_fd);
+		lock_fd=-1;
+		return 0;
+	    }
+    } else if (lckpwdf()!=0) {
+	fprintf(stderr, "Error locking files: %s\n", strerror(errno));
+	return 0;
+    }
+
+    stats.lock_wait=elapsed_since(&start);
+    clock_gettime(CLOCK_MONOTONIC, &stats.lock_taken);
+    return 1;
+}
+
+
+/* Try to unlock the account database
+ */
+int unlock_files() {
+    stats.lock_held=elapsed_since(&stats.lock_taken);
+
+    if (lock_fd!=-1) {
+	/* Closing the file releases the lock */
+	if (close(lock_fd)!=0) {
+	    lock_fd=-1;
+	    fprintf(stderr, "Error unlocking files: %s\n", strerror(errno));
+	    return 0;
+	}
+	lock_fd=-1;
+    } else if (ulckpwdf()!=0) {
+	fprintf(stderr, "Error unlocking files: %s\n", strerror(errno));
+	return 0;
+    }
+
+    return 1;
+}
+
+
+/* Write a preformatted database to a new file in one go and make sure it
+ * is on disk before it appears under its final name.
  */
-int replace_file(const char* org, const char* new, const char* backup) {
-    if (backup) {
-	int res;
+int create_file(const char* target, const char* buffer, size_t len, mode_t mode, gid_t gid) {
+    char*	wf;
+    char*	dir;
+    char*	slash;
+    int		fd;
+    int		ret=0;
 
-	if ((res=link(org, backup))==-1) {
-	    if (errno==EEXIST) {
-		if (unlink(backup)==-1) {
-		    fprintf(stderr, "Error unlinking old backupfile %s: %s\n",
-			    backup, strerror(errno));
-		    return 0;
-		}
-		res=link(org, backup);
-	    }
-	    if (res==-1) {
-		fprintf(stderr, "Error making backupfile %s: %s\n", backup, strerror(errno));
-		return 0;
-	    }
-	}
+    wf=xasprintf("%s%s", target, WRITE_EXTENSION);
+
+    if ((fd=open(wf, O_WRONLY|O_CREAT|O_TRUNC, mode))==-1) {
+	fprintf(stderr, "Failed to open %s for writing: %s\n", wf, strerror(errno));
+	free(wf);
+	return 0;
     }
 
-    if (rename(new, org)==-1) {
-	fprintf(stderr, "Error: failed to replace %s with %s: %s\n", org, new, strerror(errno));
+    /* Only root can hand the file to root and the shadow group.  Anyone
+     * else, populating files of their own, keeps it.
+     */
+    if (fchmod(fd, mode)!=0 || (geteuid()==0 && fchown(fd, 0, gid)!=0))
+	fprintf(stderr, "Error setting owner and mode of %s: %s\n", wf, strerror(errno));
+    else if (write(fd, buffer, len)!=(ssize_t)len)
+	fprintf(stderr, "Error writing %s: %s\n", wf, strerror(errno));
+    else if (fsync(fd)!=0)
+	fprintf(stderr, "Error syncing %s: %s\n", wf, strerror(errno));
+    else
+	ret=1;
+
+    if (close(fd)!=0 && ret) {
+	fprintf(stderr, "Error closing %s: %s\n", wf, strerror(errno));
+	ret=0;
+    }
+
+    if (ret)
+	ret=rename_file(wf, target);
+    else
+	unlink(wf);
+    free(wf);
+
+    if (!ret)
 	return 0;
+
+    /* Make the new directory entry durable as well */
+    dir=xstrdup(target);
+    if ((slash=strrchr(dir, '/'))!=NULL)
+	*(slash==dir ? slash+1 : slash)='\0';
+    else
+	strcpy(dir, ".");
+    if ((fd=open(dir, O_RDONLY|O_DIRECTORY))!=-1) {
+	fsync(fd);
+	close(fd);
     }
+    free(dir);
 
     return 1;
 }
 
 
-/* Try to replace a file as safely as possible. If we fail unlink the
- * new copy, since it's useless anyway.
+/* Check whether a database is missing and should be populated.  Returns 1
+ * if it is, 0 if it exists and -1 if we can't tell; then it must be left
+ * alone, as it may well exist.
  */
-int put_file_in_place(const char* source, const char* target) {
-    char*	uf;
-    int		ret;
-
-    if (opt_verbose>2)
-	printf("Replacing \"%s\" with \"%s\"\n", target, source);
-
-    uf=xasprintf("%s%s", target, BACKUP_EXTENSION);
+int database_missing(const char* file) {
+    struct stat		st;
 
-    if (!copy_filemodes(target, source)) {
-	free(uf);
+    if (lstat(file, &st)==0) {
+	if (opt_verbose)
+	    printf("%s exists, not populating it\n", file);
 	return 0;
     }
+    if (errno!=ENOENT) {
+	fprintf(stderr, "Error checking %s: %s\n", file, strerror(errno));
+	return -1;
+    }
+    return 1;
+}
 
-    ret=replace_file(target, source, uf);
-    free(uf);
 
-    return ret;
+/* Start formatting a database in memory.
+ */
+FILE* open_buffer(char** buffer, size_t* len) {
+    FILE*	output;
+
+    if ((output=open_memstream(buffer, len))==NULL)
+	fprintf(stderr, "Error opening memory stream: %s\n", strerror(errno));
+    return output;
 }
 
 
-/* Rewrite the account-database if we made any changes
+/* Create the system databases that don't exist yet straight from the
+ * master files, for example on the first boot of a stateless image.  Each
+ * file is formatted into a single buffer and written at once; entries the
+ * normal update would not add automatically are left out, and debconf is
+ * never consulted.
  */
-int commit_files() {
-    char*	wf;
-
-    if (!flag_dirty) {
-	if (opt_verbose)
-	    printf("No changes needed\n");
-	return 1;
+int populate_files() {
+    struct _node*	walk;
+    const struct _node*	shadowgroup;
+    char*		buffer;
+    size_t		len;
+    FILE*		output;
+    long		today=time(NULL)/(60*60*24);
+    int			missing;
+    int			ret=1;
+
+    shadowgroup=find_by_name(master_groups, "shadow");
+
+    if ((missing=database_missing(sys_passwd))<0)
+	ret=0;
+    else if (missing) {
+	if ((output=open_buffer(&buffer, &len))==NULL)
+	    return 0;
+	for (walk=master_accounts; walk; walk=walk->next)
+	    if (!noautoadd(specialusers, walk->id))
+		fputpwent(PW(walk), output);
+	fclose(output);
+	if (opt_dryrun)
+	    printf("Would create %s\n", sys_passwd);
+	else if (!create_file(sys_passwd, buffer, len, 0644, 0))
+	    ret=0;
+	free(buffer);
     }
 
-    if (opt_dryrun) {
-	printf("Would commit %d changes\n", flag_dirty);
-	return 1;
+    if ((missing=database_missing(sys_shadow))<0)
+	ret=0;
+    else if (missing) {
+	if ((output=open_buffer(&buffer, &len))==NULL)
+	    return 0;
+	for (walk=master_accounts; walk; walk=walk->next) {
+	    struct spwd	sp;
+
+	    if (noautoadd(specialusers, walk->id))
+		continue;
+	    memset(&sp, 0, sizeof(sp));
+	    sp.sp_namp=PW(walk)->pw_name;
+	    sp.sp_pwdp="*";
+	    sp.sp_lstchg=today;
+	    sp.sp_min=0;
+	    sp.sp_max=99999;
+	    sp.sp_warn=7;
+	    sp.sp_inact=-1;
+	    sp.sp_expire=-1;
+	    sp.sp_flag=~0UL;
+	    putspent(&sp, output);
+	}
+	fclose(output);
+	if (opt_dryrun)
+	    printf("Would create %s\n", sys_shadow);
+	else if (!create_file(sys_shadow, buffer, len, 0640, shadowgroup ? shadowgroup->id : 0))
+	    ret=0;
+	free(buffer);
     }
 
-    printf("%d changes have been made, rewriting files\n", flag_dirty);
+    if ((missing=database_missing(sys_group))<0)
+	ret=0;
+    else if (missing) {
+	if ((output=open_buffer(&buffer, &len))==NULL)
+	    return 0;
+	for (walk=master_groups; walk; walk=walk->next)
+	    if (!noautoadd(specialgroups, walk->id))
+		putgrent(GR(walk), output);
+	fclose(output);
+	if (opt_dryrun)
+	    printf("Would create %s\n", sys_group);
+	else if (!create_file(sys_group, buffer, len, 0644, 0))
+	    ret=0;
+	free(buffer);
+    }
 
-    if (opt_verbose==2)
-	printf("Writing passwd-file to %s\n", sys_passwd);
+    return ret;
+}
 
-    wf=xasprintf("%s%s", sys_passwd, WRITE_EXTENSION);
 
-    if (!write_passwd(system_accounts, wf)) {
-	free(wf);
-	return 0;
+/* Find the directory of our own cgroup in the unified hierarchy, from the
+ * "0::PATH" line of /proc/self/cgroup.  Unless we have a cgroup namespace
+ * of our own, a service runs in a group well below the root of the mount.
+ * A group outside our cgroup namespace shows up as a path with "..", which
+ * we can't follow.  Returns newly allocated memory; the root if our cgroup
+ * is unknown.
+ */
+char* cgroup_dir() {
+    FILE*	input;
+    char*	line=NULL;
+    size_t	size=0;
+    ssize_t	len;
+    char*	dir=NULL;
+
+    if ((input=fopen(PROC_SELF_CGROUP, "r"))!=NULL) {
+	while (dir==NULL && (len=getline(&line, &size, input))!=-1) {
+	    if (len>0 && line[len-1]=='\n')
+		line[--len]='\0';
+	    if (strncmp(line, "0::/", 4)==0 && strstr(line, "/..")==NULL)
+		dir=xasprintf("%s%s", CGROUP_ROOT, strcmp(line+3, "/")==0 ? "" : line+3);
+	}
+	free(line);
+	fclose(input);
     }
 
-    if (!put_file_in_place(wf, sys_passwd)) {
-	free(wf);
-	return 0;
-    }
+    return dir ? dir : xstrdup(CGROUP_ROOT);
+}
 
-    free(wf);
 
-    if (system_shadow!=NULL) {
-	if (opt_verbose==2)
-	    printf("Writing shadow-file to %s\n", sys_shadow);
+/* Move up from a cgroup directory to its parent.  Returns 0 once we are
+ * at the root of the hierarchy.
+ */
+int cgroup_parent(char* dir) {
+    char*	slash;
+
+    if (strlen(dir)<=strlen(CGROUP_ROOT) || (slash=strrchr(dir, '/'))==NULL)
+	return 0;
+    *slash='\0';
+    return 1;
+}
 
-	wf=xasprintf("%s%s", sys_shadow, WRITE_EXTENSION);
 
-	if (!write_shadow(system_shadow, wf)) {
-	    free(wf);
-	    return 0;
+/* Count the CPUs we may actually use: the affinity mask, further limited
+ * by the CPU quota of our cgroup or any of its parents.
+ */
+long available_cpus() {
+    cpu_set_t	set;
+    long	cpus;
+    FILE*	input;
+    char*	dir;
+    char*	file;
+
+    cpus=sysconf(_SC_NPROCESSORS_ONLN);
+    if (sched_getaffinity(0, sizeof(set), &set)==0)
+	cpus=CPU_COUNT(&set);
+
+    dir=cgroup_dir();
+    do {
+	file=xasprintf("%s/%s", dir, CGROUP_CPU_MAX);
+	if ((input=fopen(file, "r"))!=NULL) {
+	    char	quota[32];
+	    long	period;
+
+	    if ((fscanf(input, "%31s %ld", quota, &period)==2) &&
+		    (strcmp(quota, "max")!=0) && (period>0)) {
+		long	limit=(atol(quota)+period-1)/period;
+
+		if (limit<cpus)
+		    cpus=limit;
+	    }
+	    fclose(input);
 	}
+	free(file);
+    } while (cgroup_parent(dir));
+    free(dir);
 
-	if (!put_file_in_place(wf, sys_shadow)) {
-	    free(wf);
-	    return 0;
+    if (cpus<1)
+	cpus=1;
+    return cpus;
+}
+
+
+/* Read the memory limit of our cgroup, the lowest one set on it or any of
+ * its parents.  Returns -1 if there is none.
+ */
+long long memory_limit() {
+    FILE*	input;
+    char	limit[32];
+    long long	ret=-1;
+    char*	dir;
+    char*	file;
+
+    dir=cgroup_dir();
+    do {
+	file=xasprintf("%s/%s", dir, CGROUP_MEMORY_MAX);
+	if ((input=fopen(file, "r"))!=NULL) {
+	    if (fscanf(input, "%31s", limit)==1 && strcmp(limit, "max")!=0 &&
+		    (ret<0 || atoll(limit)<ret))
+		ret=atoll(limit);
+	    fclose(input);
 	}
+	free(file);
+    } while (cgroup_parent(dir));
+    free(dir);
 
-	free(wf);
+    return ret;
+}
+
+
+/* Pick how to read and match the databases unless --engine did, based on
+ * the size of the files and the resources we may use:
+ *
+ *   simple    walk the lists, for files of a few hundred entries
+ *   indexed   hash the entries and match them on one thread
+ *   parallel  also prefetch and write the files on threads, and match
+ *             the entries on all CPUs
+ *
+ * Explicit --jobs and --pipeline options still win.
+ */
+void choose_engine() {
+    struct stat	st;
+    long long	input=0;
+    long long	limit=memory_limit();
+    long	cpus=available_cpus();
+    int		i;
+
+    if (stat(sys_passwd, &st)==0)
+	input+=st.st_size;
+    if (stat(sys_group, &st)==0)
+	input+=st.st_size;
+    for (i=0; i<extra_count; i++) {
+	if (stat(extra_sets[i].passwd, &st)==0)
+	    input+=st.st_size;
+	if (stat(extra_sets[i].group, &st)==0)
+	    input+=st.st_size;
     }
 
-    if (opt_verbose==2)
-	printf("Writing group-file to %s\n", sys_group);
+    if (opt_engine==ENGINE_AUTO) {
+	if (input<SIMPLE_MAX)
+	    opt_engine=ENGINE_SIMPLE;
+	else if (cpus>1 && input>=PARALLEL_MIN &&
+		(limit<0 || PARALLEL_FOOTPRINT*input<limit))
+	    opt_engine=ENGINE_PARALLEL;
+	else
+	    opt_engine=ENGINE_INDEXED;
 
-    wf=xasprintf("%s%s", sys_group, WRITE_EXTENSION);
+	if (opt_verbose>2) {
+	    printf("Choosing the %s engine for %lld bytes of input on %ld CPUs", engine_names[opt_engine], input, cpus);
+	    if (limit>=0)
+		printf(" with %lld bytes of memory", limit);
+	    printf("\n");
+	}
+    } else if (opt_verbose>2)
+	printf("Using the %s engine\n", engine_names[opt_engine]);
 
-    if (!write_group(system_groups, wf)) {
-	free(wf);
-	return 0;
+    if (opt_jobs==SETTING_AUTO)
+	opt_jobs=(opt_engine==ENGINE_PARALLEL) ? 0 : 1;
+    if (opt_pipeline==SETTING_AUTO)
+	opt_pipeline=(opt_engine==ENGINE_PARALLEL);
+}
+
+
+/* Saved scheduling and I/O priority to restore after background mode */
+int			saved_policy;
+struct sched_param	saved_param;
+int			saved_ioprio;
+
+/* Drop to idle CPU and I/O priority so we don't compete with production
+ * work.  Failures are not fatal: we just run at normal priority.
+ */
+void enter_background() {
+    struct sched_param	param;
+
+    saved_policy=sched_getscheduler(0);
+    if ((saved_policy==-1) || (sched_getparam(0, &saved_param)!=0)) {
+	fprintf(stderr, "Error getting scheduling policy: %s\n", strerror(errno));
+	return;
     }
+    saved_ioprio=syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
 
-    if (!put_file_in_place(wf, sys_group)) {
-	free(wf);
-	return 0;
+    memset(&param, 0, sizeof(param));
+    if (sched_setscheduler(0, SCHED_IDLE, &param)!=0) {
+	fprintf(stderr, "Error setting idle scheduling policy: %s\n", strerror(errno));
+	return;
     }
+    flag_background=1;
 
-    free(wf);
+    if (saved_ioprio!=-1 &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0))!=0)
+	fprintf(stderr, "Error setting idle I/O priority: %s\n", strerror(errno));
 
-    return 1;
+    if (opt_verbose>2)
+	printf("Running with idle CPU and I/O priority\n");
 }
 
 
-/* Try to lock the account database
+/* Go back to the priority we started with.  This must happen before we
+ * take the lock, so that other tools waiting for it are never held up
+ * behind an idle-priority process.
  */
-int lock_files() {
-    if (lckpwdf()!=0) {
-	fprintf(stderr, "Error locking files: %s\n", strerror(errno));
-	return 0;
-    }
+void leave_background() {
+    if (!flag_background)
+	return;
 
-    return 1;
+    if (sched_setscheduler(0, saved_policy, &saved_param)!=0)
+	fprintf(stderr, "Error restoring scheduling policy: %s\n", strerror(errno));
+    if (saved_ioprio!=-1 &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, saved_ioprio)!=0)
+	fprintf(stderr, "Error restoring I/O priority: %s\n", strerror(errno));
+    flag_background=0;
+
+    if (opt_verbose>2)
+	printf("Restored normal CPU and I/O priority\n");
 }
 
 
-/* Try to unlock the account database
+/* Print the counters gathered during this run.
  */
-int unlock_files() {
-    if (ulckpwdf()!=0) {
-	fprintf(stderr, "Error unlocking files: %s\n", strerror(errno));
-	return 0;
-    }
+void print_stats() {
+    unsigned	i;
 
-    return 1;
+    if (!opt_stats)
+	return;
+
+    printf("Engine: %s\n", engine_names[opt_engine]);
+    printf("Debconf round trips: %lu (%.3fs), answers reused: %lu\n",
+	    stats.debconf_commands, stats.debconf_seconds, stats.debconf_reused);
+    if (opt_hot && stats.hot_entries)
+	printf("Master entries moved up: %lu, mean position: %.1f before, %.1f after\n",
+		stats.hot_moved, (double)stats.hot_depth_before/stats.hot_entries,
+		(double)stats.hot_depth_after/stats.hot_entries);
+    if (opt_checkpaths)
+	printf("Paths checked: %lu for %lu references (%.3fs)\n",
+		stats.paths_checked, stats.path_references, stats.path_seconds);
+    if (chown_count)
+	printf("Files checked for new owners: %lu, changed: %lu (%.3fs)\n",
+		stats.chown_scanned, stats.chown_changed, stats.chown_seconds);
+    if (!opt_nolock && !opt_dryrun && !opt_sanity)
+	printf("Lock wait: %.3fs, held: %.3fs\n", stats.lock_wait, stats.lock_held);
+    printf("Operations: %lu entries parsed, %lu index probes, %lu list steps\n",
+	    ops.parsed, ops.probes, ops.steps);
+    for (i=0; i<phase_count; i++)
+	printf("Operations for %s: %lu index probes, %lu list steps\n",
+		phases[i].name, phases[i].ops.probes, phases[i].ops.steps);
+    printf("Total time: %.3fs\n", elapsed_since(&stats.start));
 }
 
 
 /* I don't need to say what main is for, do I?
  */
 int main(int argc, char** argv) {
-    int		optc;
-    int		opt_index;
+    int			optc;
+    int			opt_index;
+    struct _read_job	passwd_job;
+    int			problems=0;
+    int			i;
 
     struct option const options[] = {
 	{ "passwd-master",	required_argument,	0,	'p' },
@@ -1374,10 +5720,35 @@ int main(int argc, char** argv) {
 	{ "sanity-check",	no_argument,		0,	's' },
 	{ "verbose",		no_argument,		0,	'v' },
 	{ "dry-run",		no_argument,		0,	'n' },
+	{ "pipeline",		no_argument,		0,	OPT_PIPELINE },
+	{ "background",		no_argument,		0,	OPT_BACKGROUND },
+	{ "stats",		no_argument,		0,	OPT_STATS },
+	{ "diff",		required_argument,	0,	OPT_DIFF },
+	{ "json",		no_argument,		0,	OPT_JSON },
+	{ "jobs",		required_argument,	0,	OPT_JOBS },
+	{ "extra-set",		required_argument,	0,	OPT_EXTRA_SET },
+	{ "sysusers",		optional_argument,	0,	OPT_SYSUSERS },
+	{ "populate",		no_argument,		0,	OPT_POPULATE },
+	{ "state-dir",		required_argument,	0,	OPT_STATE_DIR },
+	{ "full-check",		no_argument,		0,	OPT_FULL_CHECK },
+	{ "anonymize",		required_argument,	0,	OPT_ANONYMIZE },
+	{ "lock-file",		required_argument,	0,	OPT_LOCK_FILE },
+	{ "log-format",		required_argument,	0,	OPT_LOG_FORMAT },
+	{ "log-fd",		required_argument,	0,	OPT_LOG_FD },
+	{ "bulk",		required_argument,	0,	OPT_BULK },
+	{ "check-paths",	no_argument,		0,	OPT_CHECK_PATHS },
+	{ "chown-tree",		required_argument,	0,	OPT_CHOWN_TREE },
+	{ "engine",		required_argument,	0,	OPT_ENGINE },
+	{ "member-policy",	required_argument,	0,	OPT_MEMBER_POLICY },
+	{ "hot-entries",	no_argument,		0,	OPT_HOT_ENTRIES },
+	{ "subids",		optional_argument,	0,	OPT_SUBIDS },
+	{ "subid-users",	required_argument,	0,	OPT_SUBID_USERS },
 	{ "help",		no_argument,		0,	'h' },
 	{ "version",		no_argument,		0,	'V' },
 	{ 0, 0, 0, 0 }
     };
+
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
     
     while ((optc=getopt_long(argc, argv, "g:p:G:P:S:snvLhV", options, &opt_index))!=-1)
 	switch (optc)  {
@@ -1413,6 +5784,167 @@ int main(int argc, char** argv) {
 	    case 'L':
 		opt_nolock=1;
 		break;
+	    case OPT_PIPELINE:
+		opt_pipeline=1;
+		break;
+	    case OPT_BACKGROUND:
+		opt_background=1;
+		break;
+	    case OPT_STATS:
+		opt_stats=1;
+		break;
+	    case OPT_DIFF:
+		if (strcmp(optarg, "passwd")!=0 && strcmp(optarg, "group")!=0) {
+		    fprintf(stderr, "Unknown database type \"%s\" for --diff\n", optarg);
+		    return 1;
+		}
+		opt_diff=optarg;
+		break;
+	    case OPT_JSON:
+		opt_json=1;
+		break;
+	    case OPT_JOBS: {
+		char*	end;
+
+		errno=0;
+		opt_jobs=strtol(optarg, &end, 10);
+		if (*optarg=='\0' || *end!='\0' || errno!=0 || opt_jobs<0) {
+		    fprintf(stderr, "Invalid number of jobs \"%s\"\n", optarg);
+		    return 1;
+		}
+		break;
+	    }
+	    case OPT_STATE_DIR:
+		opt_state_dir=optarg;
+		break;
+	    case OPT_FULL_CHECK:
+		opt_fullcheck=1;
+		break;
+	    case OPT_ANONYMIZE:
+		opt_anonymize=optarg;
+		break;
+	    case OPT_HOT_ENTRIES:
+		opt_hot=1;
+		break;
+	    case OPT_MEMBER_POLICY: {
+		struct _member_policy*	policy;
+		char*			sep=strchr(optarg, ':');
+		const char*		name=sep ? sep+1 : optarg;
+
+		member_policies=xrealloc(member_policies, (member_policy_count+1)*sizeof(struct _member_policy));
+		policy=&member_policies[member_policy_count++];
+		policy->group=NULL;
+		if (sep) {
+		    *sep='\0';
+		    policy->group=optarg;
+		}
+		for (policy->policy=0; member_policy_names[policy->policy]; policy->policy++)
+		    if (strcmp(name, member_policy_names[policy->policy])==0)
+			break;
+		if (member_policy_names[policy->policy]==NULL) {
+		    fprintf(stderr, "Unknown member policy \"%s\"\n", name);
+		    return 1;
+		}
+		break;
+	    }
+	    case OPT_ENGINE:
+		for (opt_engine=0; engine_names[opt_engine]; opt_engine++)
+		    if (strcmp(optarg, engine_names[opt_engine])==0)
+			break;
+		if (engine_names[opt_engine]==NULL) {
+		    fprintf(stderr, "Unknown engine \"%s\"\n", optarg);
+		    return 1;
+		}
+		break;
+	    case OPT_CHOWN_TREE:
+		if (chown_count==MAX_CHOWN_TREES) {
+		    fprintf(stderr, "Too many trees to change ownership in\n");
+		    return 1;
+		}
+		chown_trees[chown_count++]=optarg;
+		break;
+	    case OPT_CHECK_PATHS:
+		opt_checkpaths=1;
+		break;
+	    case OPT_BULK:
+		opt_bulk=optarg;
+		break;
+	    case OPT_LOCK_FILE:
+		opt_lockfile=optarg;
+		break;
+	    case OPT_LOG_FORMAT:
+		if (strcmp(optarg, "text")==0)
+		    opt_jsonlog=0;
+		else if (strcmp(optarg, "jsonl")==0)
+		    opt_jsonlog=1;
+		else {
+		    fprintf(stderr, "Unknown log format \"%s\"\n", optarg);
+		    return 1;
+		}
+		break;
+	    case OPT_LOG_FD: {
+		char*	end;
+
+		opt_logfd=strtol(optarg, &end, 10);
+		if (*optarg=='\0' || *end!='\0' || opt_logfd<0) {
+		    fprintf(stderr, "Invalid file descriptor \"%s\"\n", optarg);
+		    return 1;
+		}
+		break;
+	    }
+	    case OPT_POPULATE:
+		opt_populate=1;
+		break;
+	    case OPT_SYSUSERS:
+		opt_sysusers=1;
+		if (optarg) {
+		    sysusers_dirs[0]=optarg;
+		    sysusers_dirs[1]=NULL;
+		}
+		break;
+	    case OPT_SUBIDS:
+		opt_subids=1;
+		if (optarg) {
+		    subids[0].file=xasprintf("%s/subuid", optarg);
+		    subids[1].file=xasprintf("%s/subgid", optarg);
+		}
+		break;
+	    case OPT_SUBID_USERS: {
+		char*		sep=strchr(optarg, '-');
+		unsigned long	first;
+		unsigned long	last;
+
+		if (sep)
+		    *sep++='\0';
+		if (!sep || !parse_subid_number(optarg, &first) || !parse_subid_number(sep, &last) ||
+			first>last || last>=(uid_t)-1) {
+		    fprintf(stderr, "Invalid uid range \"%s%s%s\"\n", optarg, sep ? "-" : "", sep ? sep : "");
+		    return 1;
+		}
+		subid_user_min=first;
+		subid_user_max=last;
+		break;
+	    }
+	    case OPT_EXTRA_SET: {
+		struct _fileset*	set=&extra_sets[extra_count];
+		char*			sep;
+
+		if (extra_count==MAX_EXTRA_SETS) {
+		    fprintf(stderr, "Too many extra file sets\n");
+		    return 1;
+		}
+		memset(set, 0, sizeof(*set));
+		if ((sep=strchr(optarg, ':'))!=NULL) {
+		    *sep='\0';
+		    set->passwd=optarg;
+		    set->group=sep+1;
+		} else {
+		    set->passwd=xasprintf("%s/passwd", optarg);
+		    set->group=xasprintf("%s/group", optarg);
+		}
+		extra_count++;
+		break;
+	    }
 	    case 'h':
 		usage();
 		return 0;
@@ -1424,6 +5956,27 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
+    /* In diff mode we only compare two files and never touch the system
+     * databases.  Like diff(1) we exit with 1 if there are differences.
+     */
+    if (opt_diff) {
+	struct _node*	old=NULL;
+	struct _node*	new=NULL;
+	int		isgroup=(strcmp(opt_diff, "group")==0);
+
+	if (argc-optind!=2) {
+	    fprintf(stderr, "--diff needs exactly two files to compare\n");
+	    return 1;
+	}
+
+	if ((isgroup ? read_group(&old, argv[optind]) : read_passwd(&old, argv[optind]))!=0)
+	    return 2;
+	if ((isgroup ? read_group(&new, argv[optind+1]) : read_passwd(&new, argv[optind+1]))!=0)
+	    return 2;
+
+	return diff_entries(old, new, isgroup ? "group" : "user") ? 1 : 0;
+    }
+
     /* If DEBIAN_HAS_FRONTEND is set in the environment, we're running under
      * debconf.  Enable debconf prompting unless --dry-run was also given.
      */
@@ -1434,41 +5987,169 @@ int main(int argc, char** argv) {
 	    exit(1);
 	}
 	flag_debconf=1;
+	index_init(&debconf_answers, 0);
+    }
+
+    /* After debconf, which may move stdout for its own protocol */
+    if (opt_jsonlog && !open_log())
+	return 1;
+
+    choose_engine();
+
+    /* Threads only help if our CPU quota lets them run at the same time.
+     */
+    if (opt_pipeline==1 && available_cpus()<2) {
+	if (opt_verbose>2)
+	    printf("Only one CPU available, not pipelining\n");
+	opt_pipeline=0;
     }
 
+    if (opt_jobs==0)
+	opt_jobs=available_cpus();
+
+    if (opt_background)
+	enter_background();
+
     if (read_passwd(&master_accounts, master_passwd)!=0)
 	return 2;
 
     if (read_group(&master_groups, master_group)!=0)
 	return 2;
 
-    if (read_passwd(&system_accounts, sys_passwd)!=0)
+    /* When populating we only create the missing files and don't look at
+     * existing ones at all.
+     */
+    if (opt_populate) {
+	leave_background();
+
+	if (!opt_nolock && !opt_dryrun)
+	    if (!lock_files())
+		return 3;
+
+	if (!populate_files()) {
+	    unlock_files();
+	    return 4;
+	}
+
+	if (!opt_nolock && !opt_dryrun)
+	    if (!unlock_files())
+		return 5;
+
+	print_stats();
+	return 0;
+    }
+
+    /* Anonymizing only reads the system files and writes copies elsewhere.
+     */
+    if (opt_anonymize) {
+	if (read_passwd(&system_accounts, sys_passwd)!=0)
+	    return 2;
+	if (read_group(&system_groups, sys_group)!=0)
+	    return 2;
+	return anonymize_files(opt_anonymize) ? 0 : 4;
+    }
+
+    if (opt_state_dir && !opt_fullcheck && !opt_bulk)
+	if (load_master_delta()!=0)
+	    return 2;
+
+    for (i=0; i<extra_count; i++) {
+	remember_file(extra_sets[i].passwd);
+	remember_file(extra_sets[i].group);
+	if (read_passwd(&extra_sets[i].accounts, extra_sets[i].passwd)!=0)
+	    return 2;
+	if (read_group(&extra_sets[i].groups, extra_sets[i].group)!=0)
+	    return 2;
+    }
+
+    /* With --pipeline the system passwd file is prefetched on a thread of
+     * its own while we read the group file.  We wait for it before deciding
+     * anything, so that no question is asked and nothing is logged or
+     * printed before we know that both databases could be read.  Nothing
+     * else may be read meanwhile: fgetpwent shares one buffer between all
+     * threads.
+     */
+    remember_file(sys_passwd);
+    remember_file(sys_group);
+    start_read_job(&passwd_job, read_passwd, &system_accounts, sys_passwd);
+
+    if (read_group(&system_groups, sys_group)!=0)
 	return 2;
 
-    /* Only abort on a readerror */
-    if ((read_shadow(&system_shadow, sys_shadow)!=0) && (errno!=ENOENT))
+    if (finish_read_job(&passwd_job)!=0)
 	return 2;
 
-    if (read_group(&system_groups, sys_group)!=0)
+    /* A bulk run applies only the spec it was given.  The master files are
+     * left to the next regular run.
+     */
+    if (opt_bulk) {
+	if (apply_bulk_file(opt_bulk)!=0)
+	    return 2;
+    } else {
+	start_phases();
+	process_moved_entries(specialgroups, &system_groups, master_groups, "group");
+	end_phase("moved groups");
+	process_new_group(specialgroups, &system_groups, master_groups, "group", NULL);
+	end_phase("new groups");
+	process_old_group(specialgroups, &system_groups, master_groups, "group", NULL);
+	end_phase("old groups");
+	process_changed_groups(system_groups, master_groups);
+	end_phase("changed groups");
+
+	propagate_gids();
+
+	start_phases();
+	process_moved_entries(specialusers, &system_accounts, master_accounts, "user");
+	end_phase("moved users");
+	process_new_passwd(specialusers, &system_accounts, master_accounts, "user", &accounts_added);
+	end_phase("new users");
+	process_old_passwd(specialusers, &system_accounts, master_accounts, "user", &accounts_removed);
+	end_phase("old users");
+	process_changed_accounts(system_accounts, system_groups, master_accounts);
+	end_phase("changed users");
+
+	/* sysusers.d entries come after the master files, so that the master
+	 * files win any conflict over names.
+	 */
+	if (opt_sysusers && process_sysusers(sysusers_dirs)!=0)
+	    return 2;
+
+	process_extra_sets();
+    }
+
+    if (opt_hot) {
+	hoist_master_entries(&system_accounts, master_accounts);
+	hoist_master_entries(&system_groups, master_groups);
+    }
+
+    if (opt_checkpaths)
+	problems+=check_paths();
+
+    if (opt_subids && sync_subids(&problems)!=0)
 	return 2;
 
-    process_moved_entries(specialgroups, &system_groups, master_groups, "group");
-    process_new_entries(specialgroups, &system_groups, master_groups, "group");
-    process_old_entries(specialgroups, &system_groups, master_groups, "group");
-    process_changed_groups(system_groups, master_groups);
+    if (opt_sanity) {
+	print_stats();
+	return problems ? 7 : 0;
+    }
 
-    process_moved_entries(specialusers, &system_accounts, master_accounts, "user");
-    process_new_entries(specialusers, &system_accounts, master_accounts, "user");
-    process_old_entries(specialusers, &system_accounts, master_accounts, "user");
-    process_changed_accounts(system_accounts, system_groups, master_accounts);
+    if (sync_shadow()!=0)
+	return 2;
 
-    if (opt_sanity)
-	return 0;
+    leave_background();
 
     if (!opt_nolock && !opt_dryrun)
 	if (!lock_files())
 	    return 3;
 
+    /* Nothing is written without changes, so nothing can be lost either */
+    if (flag_dirty && !opt_nolock && !opt_dryrun && !files_unchanged()) {
+	unlock_files();
+	/* The time spent waiting for the lock counts here as well */
+	print_stats();
+	return 3;
+    }
+
     umask(0077);
 
     if (!commit_files()) {
@@ -1476,13 +6157,27 @@ int main(int argc, char** argv) {
 	return 4;
     }
 
+    /* The state is saved under the same lock as the files it describes,
+     * so that concurrent runs can't mix theirs up.
+     */
+    if (opt_state_dir && !opt_bulk)
+	save_master_state();
+
     if (!opt_nolock && !opt_dryrun)
 	if (!unlock_files())
 	    return 5;
 
+    /* The files only follow once the new ids are in place, and without
+     * holding the lock for what may be a long walk.
+     */
+    if (chown_count && !opt_dryrun && migrate_ownership()!=0)
+	return 6;
+
     if (debconf!=NULL)
 	debconfclient_delete(debconf);
 
+    print_stats();
+
     if (opt_dryrun)
 	return flag_dirty;
     else